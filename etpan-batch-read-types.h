@@ -0,0 +1,42 @@
+#ifndef ETPAN_BATCH_READ_TYPES_H
+
+#define ETPAN_BATCH_READ_TYPES_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct etpan_batch_read_request {
+  int fd;
+  struct iovec iov;
+  /* bytes read or -errno */
+  ssize_t result;
+};
+
+struct etpan_io_uring {
+  int fd;
+  unsigned int entries;
+  void * sq_ring;
+  size_t sq_ring_size;
+  void * cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe * sqes;
+  size_t sqes_size;
+  unsigned int * sq_head;
+  unsigned int * sq_tail;
+  unsigned int * sq_mask;
+  unsigned int * sq_array;
+  unsigned int * cq_head;
+  unsigned int * cq_tail;
+  unsigned int * cq_mask;
+  struct io_uring_cqe * cqes;
+};
+
+struct etpan_batch_read {
+  struct etpan_batch_read_request * requests;
+  unsigned int count;
+  unsigned int max;
+  /* NULL when the reads are done with pread */
+  struct etpan_io_uring * ring;
+};
+
+#endif
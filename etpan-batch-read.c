@@ -0,0 +1,265 @@
+#include "etpan-batch-read.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define RING_ENTRIES 256
+/* result of a request not run yet */
+#define PENDING (-EINPROGRESS)
+
+static struct etpan_io_uring * uring_new(void)
+{
+  struct etpan_io_uring * ring;
+  struct io_uring_params params;
+  char * sq_ring;
+  char * cq_ring;
+  
+  ring = malloc(sizeof(* ring));
+  if (ring == NULL)
+    goto err;
+  
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (ring->fd < 0)
+    goto free_ring;
+  ring->entries = params.sq_entries;
+  
+  ring->sq_ring_size = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned int);
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto close_fd;
+  
+  ring->cq_ring_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if (ring->cq_ring == MAP_FAILED)
+    goto unmap_sq_ring;
+  
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto unmap_cq_ring;
+  
+  sq_ring = ring->sq_ring;
+  ring->sq_head = (unsigned int *) (sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned int *) (sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *) (sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *) (sq_ring + params.sq_off.array);
+  cq_ring = ring->cq_ring;
+  ring->cq_head = (unsigned int *) (cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned int *) (cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *) (cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+  
+  return ring;
+  
+ unmap_cq_ring:
+  munmap(ring->cq_ring, ring->cq_ring_size);
+ unmap_sq_ring:
+  munmap(ring->sq_ring, ring->sq_ring_size);
+ close_fd:
+  close(ring->fd);
+ free_ring:
+  free(ring);
+ err:
+  return NULL;
+}
+
+static void uring_free(struct etpan_io_uring * ring)
+{
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
+}
+
+static unsigned int uring_reap(struct etpan_io_uring * ring,
+    struct etpan_batch_read_request * requests)
+{
+  unsigned int head;
+  unsigned int tail;
+  unsigned int count;
+  
+  count = 0;
+  head = * ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe * cqe;
+    
+    cqe = &ring->cqes[head & * ring->cq_mask];
+    requests[cqe->user_data].result = cqe->res;
+    head ++;
+    count ++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  
+  return count;
+}
+
+/*
+  Runs at most ring->entries requests.
+  Returns -1 if io_uring failed, the requests that did not complete
+  are left pending.
+*/
+
+static int uring_run(struct etpan_io_uring * ring,
+    struct etpan_batch_read_request * requests, unsigned int count)
+{
+  unsigned int tail;
+  unsigned int submitted;
+  unsigned int completed;
+  unsigned int i;
+  
+  tail = * ring->sq_tail;
+  for(i = 0 ; i < count ; i ++) {
+    struct io_uring_sqe * sqe;
+    unsigned int index;
+    
+    index = tail & * ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(* sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = requests[i].fd;
+    sqe->addr = (unsigned long) &requests[i].iov;
+    sqe->len = 1;
+    sqe->off = 0;
+    sqe->user_data = i;
+    ring->sq_array[index] = index;
+    tail ++;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  
+  submitted = 0;
+  completed = 0;
+  while (completed < count) {
+    int r;
+    
+    r = syscall(__NR_io_uring_enter, ring->fd, count - submitted,
+        count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      if (submitted == 0) {
+        /* the kernel did not take the entries */
+        __atomic_store_n(ring->sq_tail, tail - count, __ATOMIC_RELEASE);
+      }
+      return -1;
+    }
+    submitted += r;
+    completed += uring_reap(ring, requests);
+  }
+  
+  return 0;
+}
+
+struct etpan_batch_read * etpan_batch_read_new(void)
+{
+  struct etpan_batch_read * batch;
+  
+  batch = malloc(sizeof(* batch));
+  if (batch == NULL)
+    return NULL;
+  
+  batch->requests = NULL;
+  batch->count = 0;
+  batch->max = 0;
+  /* falls back to pread when io_uring is not available */
+  batch->ring = uring_new();
+  
+  return batch;
+}
+
+void etpan_batch_read_free(struct etpan_batch_read * batch)
+{
+  if (batch->ring != NULL)
+    uring_free(batch->ring);
+  free(batch->requests);
+  free(batch);
+}
+
+int etpan_batch_read_uses_io_uring(struct etpan_batch_read * batch)
+{
+  return batch->ring != NULL;
+}
+
+int etpan_batch_read_add(struct etpan_batch_read * batch,
+    int fd, char * buf, size_t size)
+{
+  struct etpan_batch_read_request * request;
+  
+  if (batch->count >= batch->max) {
+    struct etpan_batch_read_request * requests;
+    unsigned int max;
+    
+    max = batch->max * 2;
+    if (max == 0)
+      max = 64;
+    requests = realloc(batch->requests, max * sizeof(* requests));
+    if (requests == NULL)
+      return -1;
+    batch->requests = requests;
+    batch->max = max;
+  }
+  
+  request = &batch->requests[batch->count];
+  request->fd = fd;
+  request->iov.iov_base = buf;
+  request->iov.iov_len = size;
+  request->result = PENDING;
+  
+  return batch->count ++;
+}
+
+void etpan_batch_read_run(struct etpan_batch_read * batch)
+{
+  unsigned int i;
+  
+  if (batch->ring != NULL) {
+    for(i = 0 ; i < batch->count ; i += batch->ring->entries) {
+      unsigned int count;
+      
+      count = batch->count - i;
+      if (count > batch->ring->entries)
+        count = batch->ring->entries;
+      if (uring_run(batch->ring, batch->requests + i, count) < 0) {
+        uring_free(batch->ring);
+        batch->ring = NULL;
+        break;
+      }
+    }
+  }
+  
+  for(i = 0 ; i < batch->count ; i ++) {
+    struct etpan_batch_read_request * request;
+    ssize_t r;
+    
+    request = &batch->requests[i];
+    if (request->result != PENDING)
+      continue;
+    r = pread(request->fd, request->iov.iov_base, request->iov.iov_len, 0);
+    if (r < 0)
+      r = -errno;
+    request->result = r;
+  }
+}
+
+ssize_t etpan_batch_read_result(struct etpan_batch_read * batch,
+    unsigned int index)
+{
+  return batch->requests[index].result;
+}
+
+void etpan_batch_read_clear(struct etpan_batch_read * batch)
+{
+  batch->count = 0;
+}
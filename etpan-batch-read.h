@@ -0,0 +1,36 @@
+#ifndef ETPAN_BATCH_READ_H
+
+#define ETPAN_BATCH_READ_H
+
+#include "etpan-batch-read-types.h"
+
+#include <sys/types.h>
+
+/*
+  Reads of many small files, such as the procfs files of the threads,
+  submitted together with io_uring when the kernel allows it, one by
+  one with pread otherwise.
+*/
+
+struct etpan_batch_read * etpan_batch_read_new(void);
+void etpan_batch_read_free(struct etpan_batch_read * batch);
+
+/* 1 if the reads go through io_uring */
+int etpan_batch_read_uses_io_uring(struct etpan_batch_read * batch);
+
+/* queues a read from the start of fd.
+   Returns the index of the request, -1 if it could not be queued: the
+   caller then reads the file itself. */
+int etpan_batch_read_add(struct etpan_batch_read * batch,
+    int fd, char * buf, size_t size);
+
+/* runs the queued reads and waits for all of them */
+void etpan_batch_read_run(struct etpan_batch_read * batch);
+
+/* bytes read by the request or -errno, valid until the next clear */
+ssize_t etpan_batch_read_result(struct etpan_batch_read * batch,
+    unsigned int index);
+
+void etpan_batch_read_clear(struct etpan_batch_read * batch);
+
+#endif
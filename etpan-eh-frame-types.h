@@ -0,0 +1,12 @@
+#ifndef ETPAN_EH_FRAME_TYPES_H
+
+#define ETPAN_EH_FRAME_TYPES_H
+
+struct etpan_function_range {
+  unsigned long start;
+  unsigned long end;
+  /* label, built on first use */
+  char * name;
+};
+
+#endif
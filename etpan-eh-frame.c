@@ -0,0 +1,427 @@
+#include "etpan-eh-frame.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* pointer encodings, see the LSB "DWARF Extensions" */
+#define DW_EH_PE_absptr  0x00
+#define DW_EH_PE_uleb128 0x01
+#define DW_EH_PE_udata2  0x02
+#define DW_EH_PE_udata4  0x03
+#define DW_EH_PE_udata8  0x04
+#define DW_EH_PE_sleb128 0x09
+#define DW_EH_PE_sdata2  0x0a
+#define DW_EH_PE_sdata4  0x0b
+#define DW_EH_PE_sdata8  0x0c
+#define DW_EH_PE_pcrel   0x10
+#define DW_EH_PE_omit    0xff
+
+struct reader {
+  const unsigned char * data;
+  const unsigned char * p;
+  const unsigned char * end;
+  unsigned long vma;
+  unsigned int address_size;
+};
+
+static int read_bytes(struct reader * reader, void * value, unsigned int len)
+{
+  if ((unsigned long) (reader->end - reader->p) < len)
+    return -1;
+  memcpy(value, reader->p, len);
+  reader->p += len;
+  
+  return 0;
+}
+
+static int read_uleb128(struct reader * reader, unsigned long * result)
+{
+  unsigned long value;
+  unsigned int shift;
+  
+  value = 0;
+  shift = 0;
+  while (reader->p < reader->end) {
+    unsigned char byte;
+    
+    byte = * reader->p;
+    reader->p ++;
+    if (shift < sizeof(value) * 8)
+      value |= (unsigned long) (byte & 0x7f) << shift;
+    shift += 7;
+    if ((byte & 0x80) == 0) {
+      * result = value;
+      return 0;
+    }
+  }
+  
+  return -1;
+}
+
+static int read_sleb128(struct reader * reader, long * result)
+{
+  unsigned long value;
+  unsigned int shift;
+  
+  value = 0;
+  shift = 0;
+  while (reader->p < reader->end) {
+    unsigned char byte;
+    
+    byte = * reader->p;
+    reader->p ++;
+    if (shift < sizeof(value) * 8)
+      value |= (unsigned long) (byte & 0x7f) << shift;
+    shift += 7;
+    if ((byte & 0x80) == 0) {
+      if ((shift < sizeof(value) * 8) && ((byte & 0x40) != 0))
+        value |= - (1UL << shift);
+      * result = (long) value;
+      return 0;
+    }
+  }
+  
+  return -1;
+}
+
+static int read_encoded(struct reader * reader, unsigned char encoding,
+    unsigned long * result)
+{
+  unsigned long field_address;
+  unsigned long value;
+  uint16_t u16;
+  uint32_t u32;
+  uint64_t u64;
+  long svalue;
+  int r;
+  
+  field_address = reader->vma + (reader->p - reader->data);
+  
+  switch (encoding & 0x0f) {
+  case DW_EH_PE_absptr:
+    if (reader->address_size == 4) {
+      r = read_bytes(reader, &u32, 4);
+      value = u32;
+    }
+    else {
+      r = read_bytes(reader, &u64, 8);
+      value = u64;
+    }
+    break;
+  case DW_EH_PE_uleb128:
+    r = read_uleb128(reader, &value);
+    break;
+  case DW_EH_PE_udata2:
+    r = read_bytes(reader, &u16, 2);
+    value = u16;
+    break;
+  case DW_EH_PE_udata4:
+    r = read_bytes(reader, &u32, 4);
+    value = u32;
+    break;
+  case DW_EH_PE_udata8:
+    r = read_bytes(reader, &u64, 8);
+    value = u64;
+    break;
+  case DW_EH_PE_sleb128:
+    r = read_sleb128(reader, &svalue);
+    value = svalue;
+    break;
+  case DW_EH_PE_sdata2:
+    r = read_bytes(reader, &u16, 2);
+    value = (int16_t) u16;
+    break;
+  case DW_EH_PE_sdata4:
+    r = read_bytes(reader, &u32, 4);
+    value = (int32_t) u32;
+    break;
+  case DW_EH_PE_sdata8:
+    r = read_bytes(reader, &u64, 8);
+    value = (int64_t) u64;
+    break;
+  default:
+    return -1;
+  }
+  if (r < 0)
+    return -1;
+  
+  /* only pc relative is used for code addresses in practice */
+  switch (encoding & 0x70) {
+  case 0:
+    break;
+  case DW_EH_PE_pcrel:
+    value += field_address;
+    break;
+  default:
+    return -1;
+  }
+  
+  * result = value;
+  
+  return 0;
+}
+
+/* returns the FDE pointer encoding, DW_EH_PE_omit on unknown CIE */
+
+static unsigned char parse_cie(struct reader * cie_reader)
+{
+  struct reader reader;
+  const char * augmentation;
+  const unsigned char * augmentation_end;
+  unsigned char version;
+  unsigned char fde_encoding;
+  unsigned long value;
+  long svalue;
+  unsigned int i;
+  
+  reader = * cie_reader;
+  if (read_bytes(&reader, &version, 1) < 0)
+    return DW_EH_PE_omit;
+  
+  augmentation = (const char *) reader.p;
+  augmentation_end = memchr(reader.p, '\0', reader.end - reader.p);
+  if (augmentation_end == NULL)
+    return DW_EH_PE_omit;
+  reader.p = augmentation_end + 1;
+  
+  if (strncmp(augmentation, "eh", 2) == 0)
+    reader.p += reader.address_size;
+  if (read_uleb128(&reader, &value) < 0)
+    return DW_EH_PE_omit;
+  if (read_sleb128(&reader, &svalue) < 0)
+    return DW_EH_PE_omit;
+  if (version == 1)
+    reader.p ++;
+  else if (read_uleb128(&reader, &value) < 0)
+    return DW_EH_PE_omit;
+  
+  fde_encoding = DW_EH_PE_absptr;
+  if (augmentation[0] != 'z')
+    return fde_encoding;
+  
+  if (read_uleb128(&reader, &value) < 0)
+    return DW_EH_PE_omit;
+  for(i = 1 ; augmentation[i] != '\0' ; i ++) {
+    unsigned char encoding;
+    
+    switch (augmentation[i]) {
+    case 'R':
+      if (read_bytes(&reader, &fde_encoding, 1) < 0)
+        return DW_EH_PE_omit;
+      return fde_encoding;
+    case 'P':
+      if (read_bytes(&reader, &encoding, 1) < 0)
+        return DW_EH_PE_omit;
+      if (read_encoded(&reader, encoding & 0x7f, &value) < 0)
+        return DW_EH_PE_omit;
+      break;
+    case 'L':
+      reader.p ++;
+      break;
+    case 'S':
+    case 'B':
+      break;
+    default:
+      return fde_encoding;
+    }
+  }
+  
+  return fde_encoding;
+}
+
+static int add_range(struct etpan_function_range ** p_list,
+    unsigned int * p_count, unsigned int * p_max,
+    unsigned long start, unsigned long end)
+{
+  struct etpan_function_range * range;
+  
+  if (* p_count >= * p_max) {
+    struct etpan_function_range * new_list;
+    unsigned int new_max;
+    
+    new_max = * p_max * 2;
+    if (new_max == 0)
+      new_max = 256;
+    new_list = realloc(* p_list, new_max * sizeof(* new_list));
+    if (new_list == NULL)
+      return -1;
+    * p_list = new_list;
+    * p_max = new_max;
+  }
+  
+  range = &(* p_list)[* p_count];
+  range->start = start;
+  range->end = end;
+  range->name = NULL;
+  (* p_count) ++;
+  
+  return 0;
+}
+
+static int compare_range(const void * a, const void * b)
+{
+  const struct etpan_function_range * range_a;
+  const struct etpan_function_range * range_b;
+  
+  range_a = a;
+  range_b = b;
+  
+  if (range_a->start < range_b->start)
+    return -1;
+  else if (range_a->start > range_b->start)
+    return 1;
+  
+  return 0;
+}
+
+int etpan_eh_frame_parse(const unsigned char * data, unsigned long size,
+    unsigned long vma, unsigned int address_size,
+    struct etpan_function_range ** p_list, unsigned int * p_count)
+{
+  struct reader reader;
+  struct etpan_function_range * list;
+  unsigned int count;
+  unsigned int max;
+  const unsigned char * last_cie;
+  unsigned char last_encoding;
+  int r;
+  
+  reader.data = data;
+  reader.p = data;
+  reader.end = data + size;
+  reader.vma = vma;
+  reader.address_size = address_size;
+  
+  list = NULL;
+  count = 0;
+  max = 0;
+  last_cie = NULL;
+  last_encoding = DW_EH_PE_omit;
+  while (reader.p < reader.end) {
+    struct reader entry_reader;
+    const unsigned char * id_field;
+    uint32_t length32;
+    uint64_t length;
+    uint32_t id;
+    
+    if (read_bytes(&reader, &length32, 4) < 0)
+      break;
+    if (length32 == 0)
+      break;
+    length = length32;
+    if (length32 == 0xffffffff) {
+      if (read_bytes(&reader, &length, 8) < 0)
+        break;
+    }
+    if (length > (uint64_t) (reader.end - reader.p))
+      break;
+    
+    entry_reader = reader;
+    entry_reader.end = reader.p + length;
+    reader.p += length;
+    
+    id_field = entry_reader.p;
+    if (read_bytes(&entry_reader, &id, 4) < 0)
+      continue;
+    
+    if (id != 0) {
+      struct reader cie_reader;
+      const unsigned char * cie;
+      unsigned char encoding;
+      unsigned long pc_begin;
+      unsigned long pc_range;
+      
+      /* FDE, id is the offset back to its CIE */
+      if (id > (unsigned long) (id_field - data))
+        continue;
+      cie = id_field - id;
+      
+      /* consecutive FDEs usually share their CIE */
+      if (cie == last_cie) {
+        encoding = last_encoding;
+        goto parse_fde;
+      }
+      
+      cie_reader = entry_reader;
+      cie_reader.p = cie;
+      cie_reader.end = reader.end;
+      if (read_bytes(&cie_reader, &length32, 4) < 0)
+        continue;
+      if (length32 == 0xffffffff)
+        cie_reader.p += 8;
+      cie_reader.p += 4;
+      if (cie_reader.p >= reader.end)
+        continue;
+      
+      encoding = parse_cie(&cie_reader);
+      last_cie = cie;
+      last_encoding = encoding;
+      
+    parse_fde:
+      if (encoding == DW_EH_PE_omit)
+        continue;
+      
+      if (read_encoded(&entry_reader, encoding, &pc_begin) < 0)
+        continue;
+      if (read_encoded(&entry_reader, encoding & 0x0f, &pc_range) < 0)
+        continue;
+      if (pc_range == 0)
+        continue;
+      
+      r = add_range(&list, &count, &max, pc_begin, pc_begin + pc_range);
+      if (r < 0)
+        goto free_list;
+    }
+  }
+  
+  qsort(list, count, sizeof(* list), compare_range);
+  
+  * p_list = list;
+  * p_count = count;
+  
+  return 0;
+  
+ free_list:
+  free(list);
+  return -1;
+}
+
+void etpan_function_range_list_free(struct etpan_function_range * list,
+    unsigned int count)
+{
+  unsigned int i;
+  
+  for(i = 0 ; i < count ; i ++)
+    free(list[i].name);
+  free(list);
+}
+
+struct etpan_function_range *
+etpan_function_range_lookup(struct etpan_function_range * list,
+    unsigned int count, unsigned long ptr)
+{
+  unsigned int low;
+  unsigned int high;
+  struct etpan_function_range * range;
+  
+  low = 0;
+  high = count;
+  while (low < high) {
+    unsigned int middle;
+    
+    middle = (low + high) / 2;
+    if (list[middle].start <= ptr)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low == 0)
+    return NULL;
+  
+  range = &list[low - 1];
+  if (ptr >= range->end)
+    return NULL;
+  
+  return range;
+}
@@ -0,0 +1,21 @@
+#ifndef ETPAN_EH_FRAME_H
+
+#define ETPAN_EH_FRAME_H
+
+#include "etpan-eh-frame-types.h"
+
+/* function boundaries from the FDEs of an .eh_frame section loaded at vma.
+   The resulting list is sorted by start address. */
+int etpan_eh_frame_parse(const unsigned char * data, unsigned long size,
+    unsigned long vma, unsigned int address_size,
+    struct etpan_function_range ** p_list, unsigned int * p_count);
+
+void etpan_function_range_list_free(struct etpan_function_range * list,
+    unsigned int count);
+
+/* range containing the address */
+struct etpan_function_range *
+etpan_function_range_lookup(struct etpan_function_range * list,
+    unsigned int count, unsigned long ptr);
+
+#endif
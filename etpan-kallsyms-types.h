@@ -0,0 +1,24 @@
+#ifndef ETPAN_KALLSYMS_TYPES_H
+
+#define ETPAN_KALLSYMS_TYPES_H
+
+#include "chash.h"
+
+struct etpan_kallsyms_entry {
+  unsigned long address;
+  const char * name;
+  /* NULL for the kernel image, interned module name otherwise */
+  const char * module;
+};
+
+struct etpan_kallsyms {
+  struct etpan_kallsyms_entry * list;
+  unsigned int count;
+  /* name -> entry */
+  chash * names;
+  chash * modules;
+  /* names of all symbols, back to back */
+  char * strings;
+};
+
+#endif
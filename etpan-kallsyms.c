@@ -0,0 +1,322 @@
+#include "etpan-kallsyms.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+/* the content is terminated by a null byte, not counted in the length */
+
+static int read_file(const char * filename, char ** p_data, size_t * p_len)
+{
+  char * data;
+  size_t len;
+  size_t max;
+  int fd;
+  
+  /* procfs files have no size, read until the end */
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    goto err;
+  
+  max = READ_CHUNK_SIZE;
+  data = malloc(max);
+  if (data == NULL)
+    goto close_fd;
+  
+  len = 0;
+  while (1) {
+    ssize_t read_count;
+    
+    if (len == max) {
+      char * new_data;
+      
+      new_data = realloc(data, max * 2);
+      if (new_data == NULL)
+        goto free_data;
+      data = new_data;
+      max *= 2;
+    }
+    
+    read_count = read(fd, data + len, max - len);
+    if (read_count < 0)
+      goto free_data;
+    if (read_count == 0)
+      break;
+    len += read_count;
+  }
+  close(fd);
+  /* the last read found room left */
+  data[len] = '\0';
+  
+  * p_data = data;
+  * p_len = len;
+  
+  return 0;
+  
+ free_data:
+  free(data);
+ close_fd:
+  close(fd);
+ err:
+  return -1;
+}
+
+static const char * intern_module(chash * modules, const char * name,
+    unsigned int len)
+{
+  chashdatum key;
+  chashdatum value;
+  char * dup_name;
+  int r;
+  
+  key.data = (void *) name;
+  key.len = len;
+  r = chash_get(modules, &key, &value);
+  if (r == 0)
+    return value.data;
+  
+  dup_name = malloc(len + 1);
+  if (dup_name == NULL)
+    return NULL;
+  memcpy(dup_name, name, len);
+  dup_name[len] = '\0';
+  
+  value.data = dup_name;
+  value.len = 0;
+  r = chash_set(modules, &key, &value, NULL);
+  if (r < 0) {
+    free(dup_name);
+    return NULL;
+  }
+  
+  return dup_name;
+}
+
+static int compare_entry(const void * a, const void * b)
+{
+  const struct etpan_kallsyms_entry * entry_a;
+  const struct etpan_kallsyms_entry * entry_b;
+  
+  entry_a = a;
+  entry_b = b;
+  
+  if (entry_a->address < entry_b->address)
+    return -1;
+  else if (entry_a->address > entry_b->address)
+    return 1;
+  
+  return 0;
+}
+
+/*
+  line format:
+  address type name [module]
+  The name strings are terminated in place, the file content buffer
+  is kept as storage for them.
+*/
+
+struct etpan_kallsyms * etpan_kallsyms_read(void)
+{
+  struct etpan_kallsyms * kallsyms;
+  char * data;
+  size_t len;
+  char * line;
+  char * data_end;
+  char * next;
+  unsigned int max;
+  unsigned int i;
+  int r;
+  
+  r = read_file("/proc/kallsyms", &data, &len);
+  if (r < 0)
+    goto err;
+  
+  kallsyms = malloc(sizeof(* kallsyms));
+  if (kallsyms == NULL)
+    goto free_data;
+  
+  kallsyms->strings = data;
+  kallsyms->count = 0;
+  max = 1024;
+  kallsyms->list = malloc(max * sizeof(* kallsyms->list));
+  if (kallsyms->list == NULL)
+    goto free_kallsyms;
+  kallsyms->modules = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  if (kallsyms->modules == NULL)
+    goto free_list;
+  kallsyms->names = NULL;
+  
+  data_end = data + len;
+  for(line = data ; line < data_end ; line = next + 1) {
+    struct etpan_kallsyms_entry * entry;
+    unsigned long address;
+    char * name;
+    char * name_end;
+    char * module;
+    char type;
+    
+    next = memchr(line, '\n', data_end - line);
+    if (next == NULL)
+      next = data_end;
+    
+    address = strtoul(line, &name, 16);
+    if ((* name != ' ') || (name + 3 >= next))
+      continue;
+    type = name[1];
+    if ((type != 't') && (type != 'T') && (type != 'w') && (type != 'W'))
+      continue;
+    name += 3;
+    
+    module = NULL;
+    name_end = memchr(name, '\t', next - name);
+    if (name_end == NULL) {
+      name_end = next;
+    }
+    else if ((name_end[1] == '[') && (next[-1] == ']')) {
+      module = (char *) intern_module(kallsyms->modules,
+          name_end + 2, next - name_end - 3);
+      if (module == NULL)
+        goto free_modules;
+    }
+    * name_end = '\0';
+    
+    if (kallsyms->count >= max) {
+      struct etpan_kallsyms_entry * new_list;
+      
+      new_list = realloc(kallsyms->list, max * 2 * sizeof(* new_list));
+      if (new_list == NULL)
+        goto free_modules;
+      kallsyms->list = new_list;
+      max *= 2;
+    }
+    entry = &kallsyms->list[kallsyms->count];
+    entry->address = address;
+    entry->name = name;
+    entry->module = module;
+    kallsyms->count ++;
+  }
+  
+  /* addresses are all zero when they are hidden from us */
+  if ((kallsyms->count == 0) || (kallsyms->list[0].address == 0))
+    goto free_modules;
+  
+  qsort(kallsyms->list, kallsyms->count, sizeof(* kallsyms->list),
+      compare_entry);
+  
+  kallsyms->names = chash_new(kallsyms->count, CHASH_COPYNONE);
+  if (kallsyms->names == NULL)
+    goto free_modules;
+  
+  for(i = 0 ; i < kallsyms->count ; i ++) {
+    struct etpan_kallsyms_entry * entry;
+    chashdatum key;
+    chashdatum value;
+    
+    entry = &kallsyms->list[i];
+    key.data = (void *) entry->name;
+    key.len = strlen(entry->name);
+    /* for duplicate static names, the first one wins */
+    r = chash_get(kallsyms->names, &key, &value);
+    if (r == 0)
+      continue;
+    value.data = entry;
+    value.len = 0;
+    r = chash_set(kallsyms->names, &key, &value, NULL);
+    if (r < 0)
+      goto free_names;
+  }
+  
+  return kallsyms;
+  
+ free_names:
+  chash_free(kallsyms->names);
+ free_modules:
+  kallsyms->names = NULL;
+  etpan_kallsyms_free(kallsyms);
+  goto err;
+ free_list:
+  free(kallsyms->list);
+ free_kallsyms:
+  free(kallsyms);
+ free_data:
+  free(data);
+ err:
+  return NULL;
+}
+
+void etpan_kallsyms_free(struct etpan_kallsyms * kallsyms)
+{
+  chashiter * iter;
+  
+  if (kallsyms->names != NULL)
+    chash_free(kallsyms->names);
+  for(iter = chash_begin(kallsyms->modules) ; iter != NULL ;
+      iter = chash_next(kallsyms->modules, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    free(value.data);
+  }
+  chash_free(kallsyms->modules);
+  free(kallsyms->list);
+  free(kallsyms->strings);
+  free(kallsyms);
+}
+
+struct etpan_kallsyms_entry *
+etpan_kallsyms_lookup(struct etpan_kallsyms * kallsyms, unsigned long ptr)
+{
+  unsigned int low;
+  unsigned int high;
+  
+  if (ptr < kallsyms->list[0].address)
+    return NULL;
+  
+  /* find the last symbol that starts at or before ptr */
+  low = 0;
+  high = kallsyms->count;
+  while (low < high) {
+    unsigned int middle;
+    
+    middle = (low + high) / 2;
+    if (kallsyms->list[middle].address <= ptr)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  
+  return &kallsyms->list[low - 1];
+}
+
+unsigned long etpan_kallsyms_resolve(struct etpan_kallsyms * kallsyms,
+    const char * frame)
+{
+  const char * name_end;
+  struct etpan_kallsyms_entry * entry;
+  chashdatum key;
+  chashdatum value;
+  unsigned long offset;
+  int r;
+  
+  name_end = frame;
+  while ((* name_end != '\0') && (* name_end != '+') &&
+      (* name_end != ' ') && (* name_end != '\n'))
+    name_end ++;
+  
+  key.data = (void *) frame;
+  key.len = name_end - frame;
+  r = chash_get(kallsyms->names, &key, &value);
+  if (r < 0)
+    return 0;
+  entry = value.data;
+  
+  offset = 0;
+  if (* name_end == '+')
+    offset = strtoul(name_end + 1, NULL, 16);
+  
+  return entry->address + offset;
+}
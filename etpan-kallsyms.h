@@ -0,0 +1,21 @@
+#ifndef ETPAN_KALLSYMS_H
+
+#define ETPAN_KALLSYMS_H
+
+#include "etpan-kallsyms-types.h"
+
+/* parses the text symbols of /proc/kallsyms.
+   Returns NULL if the addresses are hidden (kptr_restrict). */
+struct etpan_kallsyms * etpan_kallsyms_read(void);
+void etpan_kallsyms_free(struct etpan_kallsyms * kallsyms);
+
+/* symbol containing the given kernel address */
+struct etpan_kallsyms_entry *
+etpan_kallsyms_lookup(struct etpan_kallsyms * kallsyms, unsigned long ptr);
+
+/* address of a frame written as "function+0xoffset/0xsize",
+   as found in /proc/<pid>/task/<tid>/stack. Returns 0 if unknown. */
+unsigned long etpan_kallsyms_resolve(struct etpan_kallsyms * kallsyms,
+    const char * frame);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef ETPAN_MAPS_TYPES_H
+
+#define ETPAN_MAPS_TYPES_H
+
+#include "chash.h"
+
+struct etpan_map {
+  unsigned long start;
+  unsigned long end;
+  unsigned long offset;
+  /* interned, owned by the paths hash of the etpan_maps */
+  const char * filename;
+};
+
+struct etpan_maps {
+  struct etpan_map * list;
+  unsigned int count;
+  chash * paths;
+};
+
+#endif
@@ -0,0 +1,271 @@
+#include "etpan-maps.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+static inline int hex_value(char ch)
+{
+  if ((ch >= '0') && (ch <= '9'))
+    return ch - '0';
+  if ((ch >= 'a') && (ch <= 'f'))
+    return ch - 'a' + 10;
+  if ((ch >= 'A') && (ch <= 'F'))
+    return ch - 'A' + 10;
+  return -1;
+}
+
+static const char * parse_hex(const char * p, const char * end,
+    unsigned long * result)
+{
+  unsigned long value;
+  int digit;
+  
+  value = 0;
+  while (p < end) {
+    digit = hex_value(* p);
+    if (digit < 0)
+      break;
+    value = (value << 4) | digit;
+    p ++;
+  }
+  * result = value;
+  
+  return p;
+}
+
+static const char * intern_path(chash * paths, const char * path,
+    unsigned int len)
+{
+  chashdatum key;
+  chashdatum value;
+  char * dup_path;
+  int r;
+  
+  key.data = (void *) path;
+  key.len = len;
+  r = chash_get(paths, &key, &value);
+  if (r == 0)
+    return value.data;
+  
+  dup_path = malloc(len + 1);
+  if (dup_path == NULL)
+    return NULL;
+  memcpy(dup_path, path, len);
+  dup_path[len] = '\0';
+  
+  value.data = dup_path;
+  value.len = 0;
+  r = chash_set(paths, &key, &value, NULL);
+  if (r < 0) {
+    free(dup_path);
+    return NULL;
+  }
+  
+  return dup_path;
+}
+
+static int add_map(struct etpan_maps * maps, unsigned int * p_max,
+    unsigned long start, unsigned long end, unsigned long offset,
+    const char * filename)
+{
+  struct etpan_map * map;
+  
+  if (maps->count >= * p_max) {
+    unsigned int new_max;
+    struct etpan_map * new_list;
+    
+    new_max = * p_max * 2;
+    new_list = realloc(maps->list, new_max * sizeof(* new_list));
+    if (new_list == NULL)
+      return -1;
+    maps->list = new_list;
+    * p_max = new_max;
+  }
+  
+  map = &maps->list[maps->count];
+  map->start = start;
+  map->end = end;
+  map->offset = offset;
+  map->filename = filename;
+  maps->count ++;
+  
+  return 0;
+}
+
+/*
+  line format:
+  start-end perm offset dev inode    path
+  Lines that are not executable or not file-backed are rejected
+  before any number conversion is done.
+*/
+
+static int parse_line(struct etpan_maps * maps, unsigned int * p_max,
+    const char * line, const char * end)
+{
+  const char * p;
+  const char * attr;
+  const char * filename;
+  unsigned long start_value;
+  unsigned long end_value;
+  unsigned long offset_value;
+  unsigned int i;
+  
+  attr = memchr(line, ' ', end - line);
+  if (attr == NULL)
+    return 0;
+  attr ++;
+  if (end - attr < 5)
+    return 0;
+  if (attr[2] != 'x')
+    return 0;
+  
+  /* skip perm, offset, dev and inode */
+  p = attr;
+  for(i = 0 ; i < 4 ; i ++) {
+    p = memchr(p, ' ', end - p);
+    if (p == NULL)
+      return 0;
+    p ++;
+  }
+  while ((p < end) && ((* p == ' ') || (* p == '\t')))
+    p ++;
+  
+  filename = p;
+  if ((filename == end) || (filename[0] != '/'))
+    return 0;
+  
+  p = parse_hex(line, attr, &start_value);
+  if ((p == attr) || (* p != '-'))
+    return 0;
+  parse_hex(p + 1, attr, &end_value);
+  parse_hex(attr + 5, end, &offset_value);
+  
+  filename = intern_path(maps->paths, filename, end - filename);
+  if (filename == NULL)
+    return -1;
+  
+  return add_map(maps, p_max, start_value, end_value, offset_value, filename);
+}
+
+struct etpan_maps * etpan_maps_read(pid_t pid)
+{
+  char filename[PATH_MAX];
+  struct etpan_maps * maps;
+  unsigned int max;
+  char * buf;
+  size_t buf_len;
+  int skip_line;
+  int fd;
+  int r;
+  
+  snprintf(filename, sizeof(filename), "/proc/%i/maps", pid);
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    goto err;
+  
+  buf = malloc(READ_CHUNK_SIZE);
+  if (buf == NULL)
+    goto close_fd;
+  
+  maps = malloc(sizeof(* maps));
+  if (maps == NULL)
+    goto free_buf;
+  
+  max = 256;
+  maps->count = 0;
+  maps->list = malloc(max * sizeof(* maps->list));
+  if (maps->list == NULL)
+    goto free_maps;
+  maps->paths = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  if (maps->paths == NULL)
+    goto free_list;
+  
+  buf_len = 0;
+  skip_line = 0;
+  while (1) {
+    ssize_t read_count;
+    char * line;
+    char * buf_end;
+    char * next;
+    
+    read_count = read(fd, buf + buf_len, READ_CHUNK_SIZE - buf_len);
+    if (read_count < 0)
+      goto free_paths;
+    if (read_count == 0)
+      break;
+    
+    buf_end = buf + buf_len + read_count;
+    line = buf;
+    if (skip_line) {
+      next = memchr(line, '\n', buf_end - line);
+      if (next == NULL) {
+        buf_len = 0;
+        continue;
+      }
+      line = next + 1;
+      skip_line = 0;
+    }
+    while ((next = memchr(line, '\n', buf_end - line)) != NULL) {
+      r = parse_line(maps, &max, line, next);
+      if (r < 0)
+        goto free_paths;
+      line = next + 1;
+    }
+    
+    buf_len = buf_end - line;
+    if (buf_len == READ_CHUNK_SIZE) {
+      /* line too long, drop it */
+      buf_len = 0;
+      skip_line = 1;
+    }
+    else {
+      memmove(buf, line, buf_len);
+    }
+  }
+  if ((buf_len > 0) && !skip_line) {
+    r = parse_line(maps, &max, buf, buf + buf_len);
+    if (r < 0)
+      goto free_paths;
+  }
+  
+  free(buf);
+  close(fd);
+  
+  return maps;
+  
+ free_paths:
+  etpan_maps_free(maps);
+  goto free_buf;
+ free_list:
+  free(maps->list);
+ free_maps:
+  free(maps);
+ free_buf:
+  free(buf);
+ close_fd:
+  close(fd);
+ err:
+  return NULL;
+}
+
+void etpan_maps_free(struct etpan_maps * maps)
+{
+  chashiter * iter;
+  
+  for(iter = chash_begin(maps->paths) ; iter != NULL ;
+      iter = chash_next(maps->paths, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    free(value.data);
+  }
+  chash_free(maps->paths);
+  free(maps->list);
+  free(maps);
+}
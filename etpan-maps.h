@@ -0,0 +1,14 @@
+#ifndef ETPAN_MAPS_H
+
+#define ETPAN_MAPS_H
+
+#include "etpan-maps-types.h"
+
+#include <sys/types.h>
+
+/* reads the executable file-backed mappings of /proc/<pid>/maps,
+   sorted by address */
+struct etpan_maps * etpan_maps_read(pid_t pid);
+void etpan_maps_free(struct etpan_maps * maps);
+
+#endif
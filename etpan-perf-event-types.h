@@ -0,0 +1,37 @@
+#ifndef ETPAN_PERF_EVENT_TYPES_H
+
+#define ETPAN_PERF_EVENT_TYPES_H
+
+#include <sys/types.h>
+
+enum {
+  ETPAN_PERF_EVENT_PAGE_FAULTS,
+  ETPAN_PERF_EVENT_CONTEXT_SWITCHES,
+  ETPAN_PERF_EVENT_CPU_MIGRATIONS,
+  ETPAN_PERF_EVENT_COUNT,
+};
+
+struct etpan_perf_sample {
+  pid_t tid;
+  /* innermost frame first, kernel frames included.
+     Valid until the next read. */
+  unsigned long * frames;
+  unsigned int frame_count;
+};
+
+struct etpan_perf_event {
+  int type;
+  pid_t tid;
+  int fd;
+  /* metadata page followed by the data pages */
+  void * base;
+  size_t data_size;
+  /* samples dropped by the kernel when the buffer was full */
+  unsigned long long lost;
+  /* copy of the record being read, it can wrap around */
+  char * record;
+  unsigned long * frames;
+  unsigned int frame_max;
+};
+
+#endif
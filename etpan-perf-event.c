@@ -0,0 +1,224 @@
+#include "etpan-perf-event.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* a power of two */
+#define DATA_PAGE_COUNT 8
+/* the size of a record is on 16 bits */
+#define MAX_RECORD_SIZE 65536
+
+static struct {
+  const char * name;
+  const char * alias;
+  unsigned long long config;
+  unsigned long default_period;
+} event_table[ETPAN_PERF_EVENT_COUNT] = {
+  { "page-faults", "faults", PERF_COUNT_SW_PAGE_FAULTS, 100 },
+  { "context-switches", "cs", PERF_COUNT_SW_CONTEXT_SWITCHES, 1 },
+  { "cpu-migrations", "migrations", PERF_COUNT_SW_CPU_MIGRATIONS, 1 },
+};
+
+int etpan_perf_event_lookup(const char * name)
+{
+  int i;
+  
+  for(i = 0 ; i < ETPAN_PERF_EVENT_COUNT ; i ++) {
+    if ((strcmp(name, event_table[i].name) == 0) ||
+        (strcmp(name, event_table[i].alias) == 0))
+      return i;
+  }
+  
+  return -1;
+}
+
+const char * etpan_perf_event_name(int type)
+{
+  return event_table[type].name;
+}
+
+unsigned long etpan_perf_event_default_period(int type)
+{
+  return event_table[type].default_period;
+}
+
+struct etpan_perf_event * etpan_perf_event_open(pid_t tid, int type,
+    unsigned long period, int kernel)
+{
+  struct etpan_perf_event * event;
+  struct perf_event_attr attr;
+  size_t page_size;
+  int saved_errno;
+  
+  event = malloc(sizeof(* event));
+  if (event == NULL)
+    goto err;
+  
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = event_table[type].config;
+  attr.sample_period = period;
+  attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+  /* switches and migrations happen in the kernel, they are not seen
+     without it */
+  attr.exclude_kernel = !kernel;
+  attr.exclude_callchain_kernel = !kernel;
+  attr.exclude_hv = 1;
+  
+  event->fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+  if (event->fd < 0)
+    goto free_event;
+  
+  page_size = sysconf(_SC_PAGESIZE);
+  event->data_size = DATA_PAGE_COUNT * page_size;
+  event->base = mmap(NULL, event->data_size + page_size,
+      PROT_READ | PROT_WRITE, MAP_SHARED, event->fd, 0);
+  if (event->base == MAP_FAILED)
+    goto close_fd;
+  
+  event->record = malloc(MAX_RECORD_SIZE);
+  if (event->record == NULL)
+    goto unmap;
+  
+  event->type = type;
+  event->tid = tid;
+  event->lost = 0;
+  event->frames = NULL;
+  event->frame_max = 0;
+  
+  return event;
+  
+ unmap:
+  munmap(event->base, event->data_size + page_size);
+ close_fd:
+  saved_errno = errno;
+  close(event->fd);
+  errno = saved_errno;
+ free_event:
+  free(event);
+ err:
+  return NULL;
+}
+
+void etpan_perf_event_close(struct etpan_perf_event * event)
+{
+  munmap(event->base, event->data_size + sysconf(_SC_PAGESIZE));
+  close(event->fd);
+  free(event->frames);
+  free(event->record);
+  free(event);
+}
+
+static void copy_data(struct etpan_perf_event * event,
+    unsigned long long offset, void * dest, size_t size)
+{
+  char * data;
+  size_t start;
+  size_t first_size;
+  
+  data = (char *) event->base + sysconf(_SC_PAGESIZE);
+  start = offset % event->data_size;
+  first_size = size;
+  if (start + first_size > event->data_size)
+    first_size = event->data_size - start;
+  memcpy(dest, data + start, first_size);
+  memcpy((char *) dest + first_size, data, size - first_size);
+}
+
+/* sample record: pid, tid, frame count, frames */
+
+static int parse_sample(struct etpan_perf_event * event, size_t size,
+    struct etpan_perf_sample * sample)
+{
+  char * p;
+  unsigned long long nr;
+  unsigned long long i;
+  unsigned int count;
+  
+  p = event->record + sizeof(struct perf_event_header);
+  memcpy(&sample->tid, p + sizeof(unsigned int), sizeof(sample->tid));
+  p += 2 * sizeof(unsigned int);
+  memcpy(&nr, p, sizeof(nr));
+  p += sizeof(nr);
+  if ((size_t) (p - event->record) > size)
+    return 0;
+  if (nr > (size - (p - event->record)) / sizeof(nr))
+    return 0;
+  
+  if (nr > event->frame_max) {
+    unsigned long * frames;
+    
+    frames = realloc(event->frames, nr * sizeof(* frames));
+    if (frames == NULL)
+      return 0;
+    event->frames = frames;
+    event->frame_max = nr;
+  }
+  
+  count = 0;
+  for(i = 0 ; i < nr ; i ++) {
+    unsigned long long ip;
+    
+    memcpy(&ip, p + i * sizeof(ip), sizeof(ip));
+    /* PERF_CONTEXT_KERNEL and PERF_CONTEXT_USER markers */
+    if (ip >= (unsigned long long) PERF_CONTEXT_MAX)
+      continue;
+    event->frames[count] = ip;
+    count ++;
+  }
+  sample->frames = event->frames;
+  sample->frame_count = count;
+  
+  return count > 0;
+}
+
+int etpan_perf_event_read(struct etpan_perf_event * event,
+    struct etpan_perf_sample * sample)
+{
+  struct perf_event_mmap_page * meta;
+  unsigned long long head;
+  unsigned long long tail;
+  int found;
+  
+  meta = event->base;
+  head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+  tail = meta->data_tail;
+  found = 0;
+  while (!found && (tail < head)) {
+    struct perf_event_header header;
+    
+    copy_data(event, tail, &header, sizeof(header));
+    if (header.size < sizeof(header)) {
+      /* corrupted, starts again from the end */
+      tail = head;
+      break;
+    }
+    copy_data(event, tail, event->record, header.size);
+    tail += header.size;
+    
+    switch (header.type) {
+    case PERF_RECORD_SAMPLE:
+      found = parse_sample(event, header.size, sample);
+      break;
+    case PERF_RECORD_LOST:
+      {
+        unsigned long long lost;
+        
+        /* id, then the number of lost samples */
+        memcpy(&lost, event->record + sizeof(header) +
+            sizeof(unsigned long long), sizeof(lost));
+        event->lost += lost;
+      }
+      break;
+    }
+  }
+  __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+  
+  return found;
+}
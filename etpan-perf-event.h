@@ -0,0 +1,30 @@
+#ifndef ETPAN_PERF_EVENT_H
+
+#define ETPAN_PERF_EVENT_H
+
+#include "etpan-perf-event-types.h"
+
+#include <sys/types.h>
+
+/* name as used by perf, -1 if unknown */
+int etpan_perf_event_lookup(const char * name);
+const char * etpan_perf_event_name(int type);
+/* faults are too frequent to be sampled one by one */
+unsigned long etpan_perf_event_default_period(int type);
+
+/*
+  Samples the call chain of a thread every period occurrences of a
+  software event. Kernel frames need kernel events to be allowed
+  (perf_event_paranoid).
+  Returns NULL and sets errno on error.
+*/
+struct etpan_perf_event * etpan_perf_event_open(pid_t tid, int type,
+    unsigned long period, int kernel);
+void etpan_perf_event_close(struct etpan_perf_event * event);
+
+/* reads the next sample.
+   Returns 1 if a sample was read, 0 if there is none. */
+int etpan_perf_event_read(struct etpan_perf_event * event,
+    struct etpan_perf_sample * sample);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef ETPAN_PERF_MAP_TYPES_H
+
+#define ETPAN_PERF_MAP_TYPES_H
+
+#include <sys/types.h>
+
+struct etpan_perf_map_entry {
+  unsigned long start;
+  unsigned long end;
+  unsigned int serial;
+  char * name;
+};
+
+struct etpan_perf_map {
+  char * filename;
+  /* owner of the process, the file is ignored if it has another one */
+  uid_t uid;
+  int fd;
+  off_t offset;
+  struct etpan_perf_map_entry * list;
+  unsigned int count;
+  unsigned int max;
+};
+
+#endif
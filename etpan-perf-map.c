@@ -0,0 +1,256 @@
+#include "etpan-perf-map.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+struct etpan_perf_map * etpan_perf_map_new(pid_t pid)
+{
+  struct etpan_perf_map * perf_map;
+  char filename[PATH_MAX];
+  struct stat stat_info;
+  
+  perf_map = malloc(sizeof(* perf_map));
+  if (perf_map == NULL)
+    goto err;
+  
+  snprintf(filename, sizeof(filename), "/tmp/perf-%i.map", pid);
+  perf_map->filename = strdup(filename);
+  if (perf_map->filename == NULL)
+    goto free_perf_map;
+  /* only the files of root are read if the process is gone */
+  snprintf(filename, sizeof(filename), "/proc/%i", pid);
+  perf_map->uid = 0;
+  if (stat(filename, &stat_info) == 0)
+    perf_map->uid = stat_info.st_uid;
+  perf_map->fd = -1;
+  perf_map->offset = 0;
+  perf_map->list = NULL;
+  perf_map->count = 0;
+  perf_map->max = 0;
+  
+  return perf_map;
+  
+ free_perf_map:
+  free(perf_map);
+ err:
+  return NULL;
+}
+
+void etpan_perf_map_free(struct etpan_perf_map * perf_map)
+{
+  unsigned int i;
+  
+  for(i = 0 ; i < perf_map->count ; i ++)
+    free(perf_map->list[i].name);
+  free(perf_map->list);
+  if (perf_map->fd != -1)
+    close(perf_map->fd);
+  free(perf_map->filename);
+  free(perf_map);
+}
+
+static char * skip_space(char * p, char * end)
+{
+  while ((p < end) && ((* p == ' ') || (* p == '\t')))
+    p ++;
+  
+  return p;
+}
+
+/* line format: START SIZE symbolname */
+
+static int parse_line(struct etpan_perf_map * perf_map,
+    char * line, char * end)
+{
+  struct etpan_perf_map_entry * entry;
+  unsigned long start;
+  unsigned long size;
+  char * p;
+  char * name;
+  
+  * end = '\0';
+  p = skip_space(line, end);
+  start = strtoul(p, &p, 16);
+  p = skip_space(p, end);
+  size = strtoul(p, &p, 16);
+  name = skip_space(p, end);
+  if ((name == end) || (size == 0))
+    return 0;
+  
+  if (perf_map->count >= perf_map->max) {
+    unsigned int new_max;
+    struct etpan_perf_map_entry * new_list;
+    
+    new_max = perf_map->max * 2;
+    if (new_max == 0)
+      new_max = 256;
+    new_list = realloc(perf_map->list, new_max * sizeof(* new_list));
+    if (new_list == NULL)
+      return -1;
+    perf_map->list = new_list;
+    perf_map->max = new_max;
+  }
+  
+  entry = &perf_map->list[perf_map->count];
+  entry->name = strdup(name);
+  if (entry->name == NULL)
+    return -1;
+  entry->start = start;
+  entry->end = start + size;
+  entry->serial = perf_map->count;
+  perf_map->count ++;
+  
+  return 0;
+}
+
+static int compare_entry(const void * a, const void * b)
+{
+  const struct etpan_perf_map_entry * entry_a;
+  const struct etpan_perf_map_entry * entry_b;
+  
+  entry_a = a;
+  entry_b = b;
+  
+  if (entry_a->start < entry_b->start)
+    return -1;
+  else if (entry_a->start > entry_b->start)
+    return 1;
+  
+  /* most recent definition last */
+  if (entry_a->serial < entry_b->serial)
+    return -1;
+  else if (entry_a->serial > entry_b->serial)
+    return 1;
+  
+  return 0;
+}
+
+int etpan_perf_map_update(struct etpan_perf_map * perf_map)
+{
+  struct stat stat_info;
+  char * buf;
+  size_t buf_len;
+  int skip_line;
+  unsigned int previous_count;
+  int r;
+  
+  if (perf_map->fd == -1) {
+    perf_map->fd = open(perf_map->filename, O_RDONLY);
+    if (perf_map->fd == -1)
+      return 0;
+  }
+  
+  r = fstat(perf_map->fd, &stat_info);
+  if (r < 0)
+    return 0;
+  /* /tmp is writable by anyone, as perf does the file must belong to
+     the owner of the process or to root */
+  if (!S_ISREG(stat_info.st_mode) ||
+      ((stat_info.st_uid != perf_map->uid) && (stat_info.st_uid != 0))) {
+    close(perf_map->fd);
+    perf_map->fd = -1;
+    return 0;
+  }
+  if (stat_info.st_size <= perf_map->offset)
+    return 0;
+  
+  buf = malloc(READ_CHUNK_SIZE + 1);
+  if (buf == NULL)
+    return 0;
+  
+  /* only complete lines are consumed, a partially written line is read
+     again on the next update */
+  previous_count = perf_map->count;
+  buf_len = 0;
+  skip_line = 0;
+  while (1) {
+    ssize_t read_count;
+    char * line;
+    char * buf_end;
+    char * next;
+    
+    read_count = pread(perf_map->fd, buf + buf_len,
+        READ_CHUNK_SIZE - buf_len, perf_map->offset + buf_len);
+    if (read_count <= 0)
+      break;
+    
+    buf_end = buf + buf_len + read_count;
+    line = buf;
+    if (skip_line) {
+      next = memchr(line, '\n', buf_end - line);
+      if (next == NULL) {
+        perf_map->offset += read_count;
+        continue;
+      }
+      line = next + 1;
+      skip_line = 0;
+    }
+    r = 0;
+    while ((next = memchr(line, '\n', buf_end - line)) != NULL) {
+      r = parse_line(perf_map, line, next);
+      if (r < 0)
+        break;
+      line = next + 1;
+    }
+    perf_map->offset += line - buf;
+    if (r < 0)
+      break;
+    
+    buf_len = buf_end - line;
+    if (buf_len == READ_CHUNK_SIZE) {
+      /* line too long, skip it */
+      perf_map->offset += buf_len;
+      buf_len = 0;
+      skip_line = 1;
+    }
+    else {
+      memmove(buf, line, buf_len);
+    }
+  }
+  
+  free(buf);
+  
+  if (perf_map->count == previous_count)
+    return 0;
+  
+  qsort(perf_map->list, perf_map->count, sizeof(* perf_map->list),
+      compare_entry);
+  
+  return 1;
+}
+
+struct etpan_perf_map_entry *
+etpan_perf_map_lookup(struct etpan_perf_map * perf_map, unsigned long ptr)
+{
+  unsigned int low;
+  unsigned int high;
+  struct etpan_perf_map_entry * entry;
+  
+  /* find the last entry that starts at or before ptr */
+  low = 0;
+  high = perf_map->count;
+  while (low < high) {
+    unsigned int middle;
+    
+    middle = (low + high) / 2;
+    if (perf_map->list[middle].start <= ptr)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low == 0)
+    return NULL;
+  
+  entry = &perf_map->list[low - 1];
+  if (ptr >= entry->end)
+    return NULL;
+  
+  return entry;
+}
@@ -0,0 +1,22 @@
+#ifndef ETPAN_PERF_MAP_H
+
+#define ETPAN_PERF_MAP_H
+
+#include "etpan-perf-map-types.h"
+
+#include <sys/types.h>
+
+/* symbols written by JIT compilers to /tmp/perf-<pid>.map.
+   The file does not need to exist yet, it is ignored unless it belongs
+   to the owner of the process or to root. */
+struct etpan_perf_map * etpan_perf_map_new(pid_t pid);
+void etpan_perf_map_free(struct etpan_perf_map * perf_map);
+
+/* loads the lines appended since the last update.
+   Returns 1 if new symbols were loaded, 0 otherwise. */
+int etpan_perf_map_update(struct etpan_perf_map * perf_map);
+
+struct etpan_perf_map_entry *
+etpan_perf_map_lookup(struct etpan_perf_map * perf_map, unsigned long ptr);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef ETPAN_RING_TYPES_H
+
+#define ETPAN_RING_TYPES_H
+
+#include <sys/types.h>
+
+#define ETPAN_RING_MAGIC 0x676e6972
+#define ETPAN_RING_RECORD_COUNT 4096
+/* a record fills 1KB */
+#define ETPAN_RING_MAX_FRAME 126
+
+/* seq of a record being written */
+#define ETPAN_RING_WRITING ((unsigned long) -1)
+
+struct etpan_ring_record {
+  /* index of the record plus one once written */
+  unsigned long seq;
+  pid_t tid;
+  unsigned int frame_count;
+  /* innermost frame first */
+  unsigned long frames[ETPAN_RING_MAX_FRAME];
+};
+
+struct etpan_ring_header {
+  unsigned int magic;
+  unsigned int record_count;
+  /* CPU time in us between two samples of a thread */
+  unsigned int interval;
+  /* index of the next record to write */
+  unsigned long head __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct etpan_ring {
+  /* process that wrote the ring */
+  pid_t pid;
+  struct etpan_ring_header * header;
+  struct etpan_ring_record * records;
+  size_t size;
+  /* reader side */
+  unsigned long tail;
+  unsigned long lost;
+};
+
+#endif
@@ -0,0 +1,248 @@
+#include "etpan-ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void get_ring_name(pid_t pid, char * name, size_t size)
+{
+  snprintf(name, size, "/etpan-sample-%i", pid);
+}
+
+static size_t get_ring_size(unsigned int record_count)
+{
+  return sizeof(struct etpan_ring_header) +
+    record_count * sizeof(struct etpan_ring_record);
+}
+
+static struct etpan_ring * ring_map(pid_t pid, int fd, size_t size,
+    int prot)
+{
+  struct etpan_ring * ring;
+  void * data;
+  
+  data = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    goto err;
+  
+  ring = malloc(sizeof(* ring));
+  if (ring == NULL)
+    goto unmap;
+  
+  ring->pid = pid;
+  ring->header = data;
+  ring->records = (struct etpan_ring_record *) (ring->header + 1);
+  ring->size = size;
+  ring->tail = 0;
+  ring->lost = 0;
+  
+  return ring;
+  
+ unmap:
+  munmap(data, size);
+ err:
+  return NULL;
+}
+
+/*
+  The ring of a process that called exec is reused by the new image.
+  Its readers see the head go back and start over.
+*/
+
+struct etpan_ring * etpan_ring_create(unsigned int interval)
+{
+  char name[64];
+  struct etpan_ring * ring;
+  struct stat stat_buf;
+  size_t size;
+  unsigned int i;
+  int fd;
+  
+  get_ring_name(getpid(), name, sizeof(name));
+  fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+    goto err;
+  
+  /* the name is predictable, an object created by another user would
+     expose the stacks to it */
+  if (fstat(fd, &stat_buf) < 0)
+    goto close_fd;
+  if (stat_buf.st_uid != geteuid()) {
+    close(fd);
+    goto err;
+  }
+  
+  size = get_ring_size(ETPAN_RING_RECORD_COUNT);
+  if (ftruncate(fd, size) < 0)
+    goto close_fd;
+  
+  ring = ring_map(getpid(), fd, size, PROT_READ | PROT_WRITE);
+  if (ring == NULL)
+    goto close_fd;
+  close(fd);
+  
+  for(i = 0 ; i < ETPAN_RING_RECORD_COUNT ; i ++)
+    ring->records[i].seq = 0;
+  ring->header->record_count = ETPAN_RING_RECORD_COUNT;
+  ring->header->interval = interval;
+  __atomic_store_n(&ring->header->head, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->header->magic, ETPAN_RING_MAGIC, __ATOMIC_RELEASE);
+  
+  return ring;
+  
+ close_fd:
+  close(fd);
+  shm_unlink(name);
+ err:
+  return NULL;
+}
+
+void etpan_ring_unlink(struct etpan_ring * ring)
+{
+  char name[64];
+  
+  get_ring_name(ring->pid, name, sizeof(name));
+  shm_unlink(name);
+}
+
+/* owner of the process, root if it is gone */
+
+static uid_t get_process_uid(pid_t pid)
+{
+  char filename[64];
+  struct stat stat_buf;
+  
+  snprintf(filename, sizeof(filename), "/proc/%i", pid);
+  if (stat(filename, &stat_buf) < 0)
+    return 0;
+  
+  return stat_buf.st_uid;
+}
+
+struct etpan_ring * etpan_ring_open(pid_t pid)
+{
+  char name[64];
+  struct etpan_ring * ring;
+  struct etpan_ring_header header;
+  struct stat stat_buf;
+  int fd;
+  
+  get_ring_name(pid, name, sizeof(name));
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    goto err;
+  
+  if (fstat(fd, &stat_buf) < 0)
+    goto close_fd;
+  /* as for the perf maps, the ring must belong to the owner of the
+     process or to root */
+  if ((stat_buf.st_uid != get_process_uid(pid)) && (stat_buf.st_uid != 0))
+    goto close_fd;
+  if ((size_t) stat_buf.st_size < sizeof(header))
+    goto close_fd;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+    goto close_fd;
+  if ((header.magic != ETPAN_RING_MAGIC) ||
+      (header.record_count != ETPAN_RING_RECORD_COUNT) ||
+      ((size_t) stat_buf.st_size < get_ring_size(header.record_count)))
+    goto close_fd;
+  
+  ring = ring_map(pid, fd, get_ring_size(header.record_count), PROT_READ);
+  if (ring == NULL)
+    goto close_fd;
+  close(fd);
+  
+  /* only the stacks written from now on are read */
+  ring->tail = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+  
+  return ring;
+  
+ close_fd:
+  close(fd);
+ err:
+  return NULL;
+}
+
+void etpan_ring_close(struct etpan_ring * ring)
+{
+  munmap(ring->header, ring->size);
+  free(ring);
+}
+
+struct etpan_ring_record * etpan_ring_reserve(struct etpan_ring * ring,
+    unsigned long * p_index)
+{
+  struct etpan_ring_record * record;
+  unsigned long index;
+  
+  index = __atomic_fetch_add(&ring->header->head, 1, __ATOMIC_RELAXED);
+  record = &ring->records[index % ETPAN_RING_RECORD_COUNT];
+  __atomic_store_n(&record->seq, ETPAN_RING_WRITING, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  
+  * p_index = index;
+  
+  return record;
+}
+
+void etpan_ring_commit(struct etpan_ring * ring, unsigned long index)
+{
+  struct etpan_ring_record * record;
+  
+  record = &ring->records[index % ETPAN_RING_RECORD_COUNT];
+  __atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+/*
+  A record that is overwritten while being copied, or before the
+  reader got to it, is counted as lost.
+*/
+
+int etpan_ring_read(struct etpan_ring * ring,
+    struct etpan_ring_record * record)
+{
+  while (1) {
+    struct etpan_ring_record * current;
+    unsigned long head;
+    unsigned long seq;
+    
+    head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+    if (head < ring->tail) {
+      /* the ring was reset by an exec */
+      ring->tail = 0;
+    }
+    if (ring->tail >= head)
+      return 0;
+    if (head - ring->tail > ETPAN_RING_RECORD_COUNT) {
+      ring->lost += head - ETPAN_RING_RECORD_COUNT - ring->tail;
+      ring->tail = head - ETPAN_RING_RECORD_COUNT;
+    }
+    
+    current = &ring->records[ring->tail % ETPAN_RING_RECORD_COUNT];
+    seq = __atomic_load_n(&current->seq, __ATOMIC_ACQUIRE);
+    if (seq != ring->tail + 1) {
+      /* still being written */
+      if ((seq == ETPAN_RING_WRITING) || (seq < ring->tail + 1))
+        return 0;
+      ring->lost ++;
+      ring->tail ++;
+      continue;
+    }
+    
+    memcpy(record, current, sizeof(* record));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    ring->tail ++;
+    if (__atomic_load_n(&current->seq, __ATOMIC_RELAXED) != seq) {
+      ring->lost ++;
+      continue;
+    }
+    if (record->frame_count > ETPAN_RING_MAX_FRAME)
+      record->frame_count = ETPAN_RING_MAX_FRAME;
+    
+    return 1;
+  }
+}
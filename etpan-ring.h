@@ -0,0 +1,36 @@
+#ifndef ETPAN_RING_H
+
+#define ETPAN_RING_H
+
+#include "etpan-ring-types.h"
+
+#include <sys/types.h>
+
+/*
+  Stacks written by the threads of a process to shared memory, read by
+  the sampler without stopping them.
+*/
+
+/* creates the ring of the calling process, an existing one is
+   reset. NULL if it belongs to another user. */
+struct etpan_ring * etpan_ring_create(unsigned int interval);
+/* removes the name of the ring, it stays mapped */
+void etpan_ring_unlink(struct etpan_ring * ring);
+
+/* NULL if the process has no ring or if the ring belongs neither to
+   the owner of the process nor to root */
+struct etpan_ring * etpan_ring_open(pid_t pid);
+void etpan_ring_close(struct etpan_ring * ring);
+
+/* async-signal-safe, several threads can write at the same time.
+   The record is filled between reserve and commit. */
+struct etpan_ring_record * etpan_ring_reserve(struct etpan_ring * ring,
+    unsigned long * p_index);
+void etpan_ring_commit(struct etpan_ring * ring, unsigned long index);
+
+/* copies the next written record.
+   Returns 1 if a record was read, 0 if none is ready. */
+int etpan_ring_read(struct etpan_ring * ring,
+    struct etpan_ring_record * record);
+
+#endif
@@ -4,6 +4,8 @@
 
 #include "chash.h"
 #include "carray.h"
+#include "etpan-perf-map-types.h"
+#include "etpan-kallsyms-types.h"
 
 struct etpan_debug_symbol {
   const char * libname;
@@ -12,8 +14,19 @@ struct etpan_debug_symbol {
   unsigned int line;
 };
 
+/* modules shared by the symbol tables of several processes */
+struct etpan_module_cache {
+  chash * modules;
+};
+
 struct etpan_symbol_table {
   carray * list;
+  /* owned by module_cache when there is one */
+  chash * modules;
+  struct etpan_module_cache * module_cache;
+  struct etpan_perf_map * perf_map;
+  /* not owned by the symbol table */
+  struct etpan_kallsyms * kallsyms;
 };
 
 #endif
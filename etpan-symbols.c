@@ -1,7 +1,14 @@
 #include "etpan-symbols.h"
 
+#include "etpan-maps.h"
+#include "etpan-perf-map.h"
+#include "etpan-kallsyms.h"
+#include "etpan-eh-frame.h"
+
 #include <bfd.h>
+#include <dis-asm.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -168,202 +175,651 @@ static int symbol_get(bfd * abfd,
   return 1;
 }
 
-struct symtable_elt {
+struct symtable_module {
   char * filename;
   bfd * abfd;
   asymbol ** syms;
+  /* function boundaries from .eh_frame, loaded on first use
+     or when the file is stripped */
+  struct etpan_function_range * ranges;
+  unsigned int range_count;
+  int ranges_loaded;
+};
+
+static int load_function_ranges(struct symtable_module * module)
+{
+  asection * section;
+  bfd_size_type size;
+  unsigned char * data;
+  int r;
+  
+  module->ranges_loaded = 1;
+  section = bfd_get_section_by_name(module->abfd, ".eh_frame");
+  if (section == NULL)
+    return -1;
+  
+  size = bfd_get_section_size(section);
+  data = malloc(size);
+  if (data == NULL)
+    return -1;
+  
+  if (!bfd_get_section_contents(module->abfd, section, data, 0, size)) {
+    free(data);
+    return -1;
+  }
+  
+  r = etpan_eh_frame_parse(data, size,
+      bfd_get_section_vma(module->abfd, section),
+      bfd_arch_bits_per_address(module->abfd) / 8,
+      &module->ranges, &module->range_count);
+  free(data);
+  if (r < 0)
+    return -1;
+  
+  if (module->range_count == 0) {
+    free(module->ranges);
+    module->ranges = NULL;
+    return -1;
+  }
+  
+  return 0;
+}
+
+/* same relocation guess as symbol_get(): relative to the mapping first */
+
+static struct etpan_function_range *
+find_function_range(struct symtable_module * module,
+    unsigned long start, unsigned long ptr, unsigned long * p_base)
+{
+  struct etpan_function_range * range;
+  
+  if (!module->ranges_loaded)
+    load_function_ranges(module);
+  if (module->ranges == NULL)
+    return NULL;
+  
+  range = etpan_function_range_lookup(module->ranges, module->range_count,
+      ptr - start);
+  if (range != NULL) {
+    * p_base = start;
+    return range;
+  }
+  
+  range = etpan_function_range_lookup(module->ranges, module->range_count,
+      ptr);
+  if (range != NULL) {
+    * p_base = 0;
+    return range;
+  }
+  
+  return NULL;
+}
+
+static const char * function_range_name(struct symtable_module * module,
+    struct etpan_function_range * range)
+{
+  const char * basename;
+  char name[PATH_MAX];
+  
+  if (range->name != NULL)
+    return range->name;
+  
+  basename = strrchr(module->filename, '/');
+  if (basename != NULL)
+    basename ++;
+  else
+    basename = module->filename;
+  
+  snprintf(name, sizeof(name), "%s+0x%lx", basename, range->start);
+  range->name = strdup(name);
+  
+  return range->name;
+}
+
+struct symtable_elt {
+  struct symtable_module * module;
   unsigned long start;
+  unsigned long map_start;
   unsigned long end;
 };
 
+static struct symtable_elt * find_elt(struct etpan_symbol_table * symtable,
+    unsigned long ptr)
+{
+  unsigned int low;
+  unsigned int high;
+  
+  /* list is sorted by address, as /proc/<pid>/maps is */
+  low = 0;
+  high = carray_count(symtable->list);
+  while (low < high) {
+    unsigned int middle;
+    struct symtable_elt * elt;
+    
+    middle = (low + high) / 2;
+    elt = carray_get(symtable->list, middle);
+    if (ptr < elt->map_start)
+      high = middle;
+    else if (ptr >= elt->end)
+      low = middle + 1;
+    else
+      return elt;
+  }
+  
+  return NULL;
+}
+
+static int get_kernel_symbol(struct etpan_symbol_table * symtable,
+    void * ptr, struct etpan_debug_symbol * result)
+{
+  struct etpan_kallsyms_entry * entry;
+  
+  if (symtable->kallsyms == NULL)
+    return 0;
+  
+  entry = etpan_kallsyms_lookup(symtable->kallsyms, (unsigned long) ptr);
+  if (entry == NULL)
+    return 0;
+  
+  if (entry->module != NULL)
+    result->libname = entry->module;
+  else
+    result->libname = "kernel";
+  result->functionname = entry->name;
+  result->filename = NULL;
+  result->line = 0;
+  
+  return 1;
+}
+
+/* code that is not file-backed may have been generated by a JIT */
+
+static int get_jit_symbol(struct etpan_symbol_table * symtable,
+    void * ptr, struct etpan_debug_symbol * result)
+{
+  struct etpan_perf_map_entry * entry;
+  
+  entry = etpan_perf_map_lookup(symtable->perf_map, (unsigned long) ptr);
+  if (entry == NULL)
+    return 0;
+  
+  result->libname = symtable->perf_map->filename;
+  result->functionname = entry->name;
+  result->filename = NULL;
+  result->line = 0;
+  
+  return 1;
+}
+
 int etpan_get_symbol(struct etpan_symbol_table * symtable,
     void * ptr, struct etpan_debug_symbol * result)
 {
-  unsigned int i;
+  struct symtable_elt * elt;
+  int r;
   
-  for(i = 0 ; i < carray_count(symtable->list) ; i ++) {
-    struct symtable_elt * elt;
-    int r;
+  elt = find_elt(symtable, (unsigned long) ptr);
+  if (elt == NULL) {
+    if (get_kernel_symbol(symtable, ptr, result))
+      return 1;
+    return get_jit_symbol(symtable, ptr, result);
+  }
+  
+  if (elt->module->syms == NULL) {
+    struct etpan_function_range * range;
+    unsigned long base;
     
-    elt = carray_get(symtable->list, i);
-    if (((unsigned long) ptr >= elt->start) &&
-        ((unsigned long) ptr < elt->end)) {
-      r = symbol_get(elt->abfd,
-          elt->syms,
-          (void *) elt->start,
-          ptr, result);
-      if (r) {
-        result->libname = bfd_get_filename(elt->abfd);
-        return 1;
-      }
+    range = find_function_range(elt->module, elt->start,
+        (unsigned long) ptr, &base);
+    if (range == NULL)
       return 0;
-    }
+    
+    result->functionname = function_range_name(elt->module, range);
+    result->filename = NULL;
+    result->line = 0;
+    result->libname = bfd_get_filename(elt->module->abfd);
+    return 1;
+  }
+  
+  r = symbol_get(elt->module->abfd,
+      elt->module->syms,
+      (void *) elt->start,
+      ptr, result);
+  if (r) {
+    result->libname = bfd_get_filename(elt->module->abfd);
+    return 1;
+  }
+  
+  return 0;
+}
+
+int etpan_get_function_start(struct etpan_symbol_table * symtable,
+    void * ptr, void ** p_start)
+{
+  struct symtable_elt * elt;
+  struct etpan_function_range * range;
+  unsigned long base;
+  
+  elt = find_elt(symtable, (unsigned long) ptr);
+  if (elt == NULL)
+    return 0;
+  if (elt->module->syms != NULL)
+    return 0;
+  
+  range = find_function_range(elt->module, elt->start,
+      (unsigned long) ptr, &base);
+  if (range == NULL)
+    return 0;
+  
+  * p_start = (void *) (base + range->start);
+  
+  return 1;
+}
+
+int etpan_get_function_range(struct etpan_symbol_table * symtable,
+    void * ptr, void ** p_start, void ** p_end)
+{
+  struct symtable_elt * elt;
+  struct etpan_function_range * range;
+  unsigned long base;
+  
+  elt = find_elt(symtable, (unsigned long) ptr);
+  if (elt == NULL)
+    return 0;
+  
+  range = find_function_range(elt->module, elt->start,
+      (unsigned long) ptr, &base);
+  if (range == NULL)
+    return 0;
+  
+  * p_start = (void *) (base + range->start);
+  * p_end = (void *) (base + range->end);
+  
+  return 1;
+}
+
+struct section_lookup {
+  bfd_vma vma;
+  bfd_size_type size;
+  asection * section;
+};
+
+static void find_section_in_file(bfd * abfd, asection * section,
+    void * data)
+{
+  struct section_lookup * lookup;
+  bfd_vma vma;
+  
+  lookup = data;
+  if (lookup->section != NULL)
+    return;
+  
+  if ((bfd_get_section_flags(abfd, section) & SEC_ALLOC) == 0)
+    return;
+  
+  vma = bfd_get_section_vma(abfd, section);
+  if (lookup->vma < vma)
+    return;
+  if (lookup->vma + lookup->size > vma + bfd_get_section_size(section))
+    return;
+  
+  lookup->section = section;
+}
+
+struct disassembly_line {
+  char text[256];
+  size_t len;
+};
+
+static int disassembly_printf(void * stream, const char * format, ...)
+{
+  struct disassembly_line * line;
+  va_list args;
+  int r;
+  
+  line = stream;
+  if (line->len >= sizeof(line->text))
+    return 0;
+  
+  va_start(args, format);
+  r = vsnprintf(line->text + line->len, sizeof(line->text) - line->len,
+      format, args);
+  va_end(args);
+  if (r > 0)
+    line->len += r;
+  if (line->len >= sizeof(line->text))
+    line->len = sizeof(line->text) - 1;
+  
+  return r;
+}
+
+int etpan_disassemble_function(struct etpan_symbol_table * symtable,
+    void * ptr,
+    void (* callback)(void * address, const char * text, void * cb_data),
+    void * cb_data)
+{
+  struct symtable_elt * elt;
+  struct etpan_function_range * range;
+  struct section_lookup lookup;
+  struct disassembly_line line;
+  disassemble_info info;
+  disassembler_ftype disassemble;
+  bfd * abfd;
+  bfd_byte * code;
+  unsigned long base;
+  bfd_vma pc;
+  
+  elt = find_elt(symtable, (unsigned long) ptr);
+  if (elt == NULL)
+    goto err;
+  
+  range = find_function_range(elt->module, elt->start,
+      (unsigned long) ptr, &base);
+  if (range == NULL)
+    goto err;
+  
+  abfd = elt->module->abfd;
+  lookup.vma = range->start;
+  lookup.size = range->end - range->start;
+  lookup.section = NULL;
+  bfd_map_over_sections(abfd, find_section_in_file, &lookup);
+  if (lookup.section == NULL)
+    goto err;
+  
+  disassemble = disassembler(bfd_get_arch(abfd), bfd_big_endian(abfd),
+      bfd_get_mach(abfd), abfd);
+  if (disassemble == NULL)
+    goto err;
+  
+  code = malloc(lookup.size);
+  if (code == NULL)
+    goto err;
+  if (!bfd_get_section_contents(abfd, lookup.section, code,
+          lookup.vma - bfd_get_section_vma(abfd, lookup.section),
+          lookup.size))
+    goto free_code;
+  
+  init_disassemble_info(&info, &line, disassembly_printf);
+  info.arch = bfd_get_arch(abfd);
+  info.mach = bfd_get_mach(abfd);
+  info.buffer = code;
+  info.buffer_vma = lookup.vma;
+  info.buffer_length = lookup.size;
+  disassemble_init_for_target(&info);
+  
+  pc = range->start;
+  while (pc < range->end) {
+    int len;
+    
+    line.len = 0;
+    line.text[0] = '\0';
+    len = disassemble(pc, &info);
+    if (len <= 0)
+      break;
+    
+    callback((void *) (base + pc), line.text, cb_data);
+    pc += len;
   }
   
+  free(code);
+  
   return 0;
+  
+ free_code:
+  free(code);
+ err:
+  return -1;
+}
+
+static void module_free(struct symtable_module * module)
+{
+  if (module->ranges != NULL)
+    etpan_function_range_list_free(module->ranges, module->range_count);
+  if (module->syms != NULL)
+    free(module->syms);
+  if (module->abfd != NULL)
+    bfd_close(module->abfd);
+  free(module->filename);
+  free(module);
+}
+
+/* one module per file, shared by all the mappings of that file */
+
+static struct symtable_module * get_module(chash * modules,
+    const char * filename)
+{
+  chashdatum key;
+  chashdatum value;
+  struct symtable_module * module;
+  int r;
+  
+  key.data = (void *) filename;
+  key.len = strlen(filename);
+  r = chash_get(modules, &key, &value);
+  if (r == 0)
+    return value.data;
+  
+  module = malloc(sizeof(* module));
+  if (module == NULL)
+    return NULL;
+  
+  module->filename = strdup(filename);
+  module->syms = NULL;
+  module->ranges = NULL;
+  module->range_count = 0;
+  module->ranges_loaded = 0;
+  module->abfd = get_bfd(module->filename);
+  if (module->abfd != NULL) {
+    module->syms = slurp_symtab(module->abfd, module->filename);
+    if (module->syms == NULL) {
+      r = load_function_ranges(module);
+      if (r < 0) {
+        bfd_close(module->abfd);
+        module->abfd = NULL;
+      }
+    }
+  }
+  
+  /* remember files that could not be loaded too */
+  value.data = module;
+  value.len = 0;
+  r = chash_set(modules, &key, &value, NULL);
+  if (r < 0) {
+    module_free(module);
+    return NULL;
+  }
+  
+  return module;
+}
+
+static void modules_free(chash * modules)
+{
+  chashiter * iter;
+  
+  for(iter = chash_begin(modules) ; iter != NULL ;
+      iter = chash_next(modules, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    module_free(value.data);
+  }
+  chash_free(modules);
+}
+
+struct etpan_module_cache * etpan_module_cache_new(void)
+{
+  struct etpan_module_cache * cache;
+  
+  cache = malloc(sizeof(* cache));
+  if (cache == NULL)
+    return NULL;
+  
+  cache->modules = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  if (cache->modules == NULL) {
+    free(cache);
+    return NULL;
+  }
+  
+  return cache;
+}
+
+void etpan_module_cache_free(struct etpan_module_cache * cache)
+{
+  modules_free(cache->modules);
+  free(cache);
 }
 
 struct etpan_symbol_table * etpan_get_symtable(pid_t pid)
 {
-  char dirname[PATH_MAX];
-  FILE * f;
-  char buf[PATH_MAX];
+  return etpan_get_symtable_with_cache(pid, NULL);
+}
+
+struct etpan_symbol_table *
+etpan_get_symtable_with_cache(pid_t pid, struct etpan_module_cache * cache)
+{
+  struct etpan_maps * maps;
   carray * list;
+  chash * modules;
+  struct etpan_perf_map * perf_map;
   struct etpan_symbol_table * symtable;
   unsigned int i;
   int r;
   
   bootstrap();
   
-  list = carray_new(16);
-  if (list == NULL)
+  maps = etpan_maps_read(pid);
+  if (maps == NULL)
     goto err;
   
-  snprintf(dirname, sizeof(dirname), "/proc/%i/maps", pid);
-  f = fopen(dirname, "r");
-  while (fgets(buf, sizeof(buf), f)) {
-    char * zone;
-    char * zone_end;
-    char * attr;
-    char * offset;
-    char * device;
-    char * size;
-    char * filename;
-    char * p;
-    char * next;
-    unsigned long zone_value;
-    unsigned long zone_end_value;
-    unsigned long offset_value;
-    unsigned long size_value;
+  list = carray_new(maps->count);
+  if (list == NULL)
+    goto free_maps;
+  
+  if (cache != NULL)
+    modules = cache->modules;
+  else
+    modules = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  if (modules == NULL)
+    goto free_list;
+  
+  perf_map = etpan_perf_map_new(pid);
+  if (perf_map == NULL)
+    goto free_modules_hash;
+  etpan_perf_map_update(perf_map);
+  
+  for(i = 0 ; i < maps->count ; i ++) {
+    struct etpan_map * map;
+    struct symtable_module * module;
     struct symtable_elt * elt;
     
-    p = buf;
-    
-    zone = buf;
-    next = strchr(p, ' ');
-    if (next == NULL)
-      continue;
-    * next = '\0';
-    
-    p = next + 1;
-    attr = p;
-    next = strchr(p, ' ');
-    if (next == NULL)
-      continue;
-    * next = '\0';
-    
-    p = next + 1;
-    offset = p;
-    next = strchr(p, ' ');
-    if (next == NULL)
-      continue;
-    * next = '\0';
-    
-    p = next + 1;
-    device = p;
-    next = strchr(p, ' ');
-    if (next == NULL)
-      continue;
-    * next = '\0';
-
-    p = next + 1;
-    size = p;
-    next = strchr(p, ' ');
-    if (next == NULL)
+    map = &maps->list[i];
+    module = get_module(modules, map->filename);
+    if (module == NULL)
+      goto free_modules;
+    if (module->abfd == NULL)
       continue;
-    * next = '\0';
-    
-    p = next + 1;
-    while ((* p == ' ') || (*p == '\t'))
-      p ++;
-    
-    filename = p;
-    if (filename[0] != '/')
-      continue;
-    
-    if (attr[2] != 'x')
-      continue;
-    
-    p = strchr(zone, '-');
-    if (p == NULL)
-      continue;
-    * p = '\0';
-    p ++;
-    zone_end = p;
-    
-    p = strchr(filename, '\n');
-    if (p == NULL)
-      continue;
-    * p = '\0';
-    
-    zone_value = strtoul(zone, NULL, 16);
-    zone_end_value = strtoul(zone_end, NULL, 16);
-    offset_value = strtoul(offset, NULL, 16);
-    size_value = strtoul(size, NULL, 16);
     
     elt = malloc(sizeof(* elt));
     if (elt == NULL)
-      goto free_list;
+      goto free_modules;
     
-    elt->filename = strdup(filename);
-    elt->abfd = get_bfd(elt->filename);
-    if (elt->abfd == NULL) {
-      free(elt->filename);
-      free(elt);
-      continue;
-    }
+    elt->module = module;
+    elt->start = map->start - map->offset;
+    elt->map_start = map->start;
+    elt->end = map->end;
     
-    elt->syms = slurp_symtab(elt->abfd, elt->filename);
-    if (elt->syms == NULL) {
-      bfd_close(elt->abfd);
-      free(elt->filename);
+    r = carray_add(list, elt, NULL);
+    if (r < 0) {
       free(elt);
-      continue;
+      goto free_modules;
     }
-    elt->start = zone_value + offset_value;
-    elt->end = zone_end_value;
-    
-    r = carray_add(list, elt, NULL);
-    if (r < 0)
-      goto free_list;
   }
   
   symtable = malloc(sizeof(* symtable));
   if (symtable == NULL)
-    goto free_list;
+    goto free_modules;
   
   symtable->list = list;
+  symtable->modules = modules;
+  symtable->module_cache = cache;
+  symtable->perf_map = perf_map;
+  symtable->kallsyms = NULL;
+  
+  etpan_maps_free(maps);
   
   return symtable;
   
+ free_modules:
+  for(i = 0 ; i < carray_count(list) ; i ++)
+    free(carray_get(list, i));
+  etpan_perf_map_free(perf_map);
+ free_modules_hash:
+  if (cache == NULL)
+    modules_free(modules);
  free_list:
-  for(i = 0 ; i < carray_count(list) ; i ++) {
-    struct symtable_elt * elt;
-    
-    elt = carray_get(list, i);
-    bfd_close(elt->abfd);
-    free(elt->filename);
-    free(elt);
-  }
   carray_free(list);
+ free_maps:
+  etpan_maps_free(maps);
  err:
   return NULL;
 }
 
-void etpan_symbol_table_free(struct etpan_symbol_table * symtable)
+int etpan_symbol_table_same_layout(struct etpan_symbol_table * a,
+    struct etpan_symbol_table * b)
 {
   unsigned int i;
   
-  for(i = 0 ; i < carray_count(symtable->list) ; i ++) {
-    struct symtable_elt * elt;
+  if (carray_count(a->list) != carray_count(b->list))
+    return 0;
+  
+  for(i = 0 ; i < carray_count(a->list) ; i ++) {
+    struct symtable_elt * elt_a;
+    struct symtable_elt * elt_b;
     
-    elt = carray_get(symtable->list, i);
-    free(elt->syms);
-    bfd_close(elt->abfd);
-    free(elt->filename);
-    free(elt);
+    elt_a = carray_get(a->list, i);
+    elt_b = carray_get(b->list, i);
+    if ((elt_a->map_start != elt_b->map_start) ||
+        (elt_a->end != elt_b->end) ||
+        (elt_a->start != elt_b->start) ||
+        (strcmp(elt_a->module->filename, elt_b->module->filename) != 0))
+      return 0;
   }
+  
+  return 1;
+}
+
+int etpan_symbol_table_has_address(struct etpan_symbol_table * symtable,
+    void * ptr)
+{
+  if (find_elt(symtable, (unsigned long) ptr) != NULL)
+    return 1;
+  if ((symtable->kallsyms != NULL) &&
+      (etpan_kallsyms_lookup(symtable->kallsyms, (unsigned long) ptr) != NULL))
+    return 1;
+  
+  return 0;
+}
+
+void etpan_symbol_table_set_kallsyms(struct etpan_symbol_table * symtable,
+    struct etpan_kallsyms * kallsyms)
+{
+  symtable->kallsyms = kallsyms;
+}
+
+void etpan_symbol_table_update_jit(struct etpan_symbol_table * symtable)
+{
+  etpan_perf_map_update(symtable->perf_map);
+}
+
+void etpan_symbol_table_free(struct etpan_symbol_table * symtable)
+{
+  unsigned int i;
+  
+  for(i = 0 ; i < carray_count(symtable->list) ; i ++)
+    free(carray_get(symtable->list, i));
   carray_free(symtable->list);
+  if (symtable->module_cache == NULL)
+    modules_free(symtable->modules);
+  etpan_perf_map_free(symtable->perf_map);
   
   free(symtable);
 }
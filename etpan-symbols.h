@@ -9,7 +9,48 @@
 struct etpan_symbol_table * etpan_get_symtable(pid_t pid);
 void etpan_symbol_table_free(struct etpan_symbol_table * symtable);
 
+struct etpan_module_cache * etpan_module_cache_new(void);
+void etpan_module_cache_free(struct etpan_module_cache * cache);
+
+/* each file is loaded once for all the tables using the cache,
+   the cache must outlive them */
+struct etpan_symbol_table *
+etpan_get_symtable_with_cache(pid_t pid, struct etpan_module_cache * cache);
+
+/* both tables map the same files at the same addresses */
+int etpan_symbol_table_same_layout(struct etpan_symbol_table * a,
+    struct etpan_symbol_table * b);
+
+/* ptr is in a file mapped when the table was read or is a known
+   kernel address */
+int etpan_symbol_table_has_address(struct etpan_symbol_table * symtable,
+    void * ptr);
+
+/* resolves kernel addresses too, kallsyms must outlive the table */
+void etpan_symbol_table_set_kallsyms(struct etpan_symbol_table * symtable,
+    struct etpan_kallsyms * kallsyms);
+
+/* loads the symbols written by a JIT since the last update, the
+   lookups only use the loaded ones */
+void etpan_symbol_table_update_jit(struct etpan_symbol_table * symtable);
+
 int etpan_get_symbol(struct etpan_symbol_table * symtable,
     void * ptr, struct etpan_debug_symbol * result);
 
+/* start of the function containing ptr, when the function boundaries
+   were synthesized for a stripped file. Returns 0 otherwise. */
+int etpan_get_function_start(struct etpan_symbol_table * symtable,
+    void * ptr, void ** p_start);
+
+/* bounds of the function containing ptr, from .eh_frame */
+int etpan_get_function_range(struct etpan_symbol_table * symtable,
+    void * ptr, void ** p_start, void ** p_end);
+
+/* calls the callback with the address and text of each instruction
+   of the function containing ptr */
+int etpan_disassemble_function(struct etpan_symbol_table * symtable,
+    void * ptr,
+    void (* callback)(void * address, const char * text, void * cb_data),
+    void * cb_data);
+
 #endif
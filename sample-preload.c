@@ -0,0 +1,232 @@
+/*
+  In-process collector, loaded with LD_PRELOAD=libsample-preload.so.
+  Each thread has a timer on its CPU time. On expiry, the SIGPROF
+  handler follows the frame pointers of the interrupted code and writes
+  the stack to the shared memory ring read by sample -p.
+  SAMPLE_INTERVAL sets the CPU time between two samples in us.
+*/
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "etpan-ring.h"
+
+#define DEFAULT_INTERVAL 10000
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+
+struct thread_start {
+  void * (* start_routine)(void *);
+  void * arg;
+};
+
+static struct etpan_ring * ring = NULL;
+static unsigned int interval = DEFAULT_INTERVAL;
+static pthread_key_t timer_key;
+static int (* real_pthread_create)(pthread_t *, const pthread_attr_t *,
+    void * (*)(void *), void *);
+
+static THREAD_LOCAL pid_t thread_tid;
+static THREAD_LOCAL timer_t thread_timer;
+/* frame pointers outside of the stack are not followed */
+static THREAD_LOCAL unsigned long stack_low;
+static THREAD_LOCAL unsigned long stack_high;
+
+static void profile_handler(int sig, siginfo_t * info, void * data)
+{
+  ucontext_t * context;
+  struct etpan_ring_record * record;
+  unsigned long index;
+  unsigned long fp;
+  unsigned int count;
+  int saved_errno;
+  
+  (void) sig;
+  (void) info;
+  
+  if (ring == NULL)
+    return;
+  
+  saved_errno = errno;
+  context = data;
+  record = etpan_ring_reserve(ring, &index);
+  record->tid = thread_tid;
+#ifdef __x86_64
+  record->frames[0] = context->uc_mcontext.gregs[REG_RIP];
+  fp = context->uc_mcontext.gregs[REG_RBP];
+#else
+  record->frames[0] = context->uc_mcontext.gregs[REG_EIP];
+  fp = context->uc_mcontext.gregs[REG_EBP];
+#endif
+  count = 1;
+  while ((count < ETPAN_RING_MAX_FRAME) &&
+      (fp >= stack_low) && (fp + 2 * sizeof(long) <= stack_high) &&
+      (fp % sizeof(long) == 0)) {
+    unsigned long nextfp;
+    
+    nextfp = ((unsigned long *) fp)[0];
+    record->frames[count] = ((unsigned long *) fp)[1];
+    count ++;
+    
+    /* frame pointers grow toward the outermost frame */
+    if (nextfp <= fp)
+      break;
+    fp = nextfp;
+  }
+  record->frame_count = count;
+  etpan_ring_commit(ring, index);
+  errno = saved_errno;
+}
+
+static void get_stack_bounds(void)
+{
+  pthread_attr_t attr;
+  void * addr;
+  size_t size;
+  
+  stack_low = 0;
+  stack_high = 0;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0)
+    return;
+  if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+    stack_low = (unsigned long) addr;
+    stack_high = (unsigned long) addr + size;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+/* starts the CPU time timer of the calling thread */
+
+static void arm_thread_timer(void)
+{
+  struct sigevent event;
+  struct itimerspec spec;
+  
+  thread_tid = syscall(SYS_gettid);
+  get_stack_bounds();
+  
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = thread_tid;
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &thread_timer) < 0)
+    return;
+  
+  spec.it_interval.tv_sec = interval / 1000000;
+  spec.it_interval.tv_nsec = (interval % 1000000) * 1000;
+  spec.it_value = spec.it_interval;
+  if (timer_settime(thread_timer, 0, &spec, NULL) < 0) {
+    timer_delete(thread_timer);
+    return;
+  }
+  
+  /* the timer is deleted when the thread exits */
+  pthread_setspecific(timer_key, &thread_timer);
+}
+
+static void delete_thread_timer(void * data)
+{
+  timer_t * timer;
+  
+  timer = data;
+  timer_delete(* timer);
+}
+
+static void * thread_start(void * data)
+{
+  struct thread_start start;
+  
+  memcpy(&start, data, sizeof(start));
+  free(data);
+  arm_thread_timer();
+  
+  return start.start_routine(start.arg);
+}
+
+int pthread_create(pthread_t * thread, const pthread_attr_t * attr,
+    void * (* start_routine)(void *), void * arg)
+{
+  struct thread_start * start;
+  int r;
+  
+  if (real_pthread_create == NULL)
+    real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+  if (real_pthread_create == NULL)
+    return EAGAIN;
+  if (ring == NULL)
+    return real_pthread_create(thread, attr, start_routine, arg);
+  
+  start = malloc(sizeof(* start));
+  if (start == NULL)
+    return EAGAIN;
+  start->start_routine = start_routine;
+  start->arg = arg;
+  
+  r = real_pthread_create(thread, attr, thread_start, start);
+  if (r != 0)
+    free(start);
+  
+  return r;
+}
+
+/* the ring belongs to the parent, the threads of a forked child are
+   not sampled */
+
+static void forget_ring(void)
+{
+  ring = NULL;
+}
+
+__attribute__((constructor))
+static void collector_init(void)
+{
+  struct sigaction action;
+  char * value;
+  
+  value = getenv("SAMPLE_INTERVAL");
+  if (value != NULL) {
+    interval = strtoul(value, NULL, 10);
+    if (interval == 0)
+      interval = DEFAULT_INTERVAL;
+  }
+  
+  if (pthread_key_create(&timer_key, delete_thread_timer) != 0)
+    return;
+  
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = profile_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) < 0)
+    return;
+  
+  ring = etpan_ring_create(interval);
+  if (ring == NULL)
+    return;
+  pthread_atfork(NULL, NULL, forget_ring);
+  
+  arm_thread_timer();
+}
+
+__attribute__((destructor))
+static void collector_done(void)
+{
+  /* a forked child does not own the ring. Other threads may still
+     be sampled until the process is gone. */
+  if ((ring != NULL) && (ring->pid == getpid()))
+    etpan_ring_unlink(ring);
+}
@@ -5,14 +5,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <limits.h>
 #include <dirent.h>
 #include <errno.h>
 #include <string.h>
 #include <bfd.h>
 #include <libgen.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 
 #include "etpan-symbols.h"
+#include "etpan-kallsyms.h"
+#include "etpan-ring.h"
+#include "etpan-perf-event.h"
+#include "etpan-batch-read.h"
 #include "chash.h"
 #include "carray.h"
 
@@ -23,7 +36,9 @@ static int attach(pid_t pid)
   
   r = ptrace(PTRACE_ATTACH, pid, 0, 0);
   if (r < 0) {
-    fprintf(stderr, "could not attach\n");
+    /* the thread exited, not an error */
+    if (errno != ESRCH)
+      fprintf(stderr, "could not attach\n");
     return r;
   }
   
@@ -44,7 +59,9 @@ static int attach_thread(pid_t pid)
   
   r = ptrace(PTRACE_ATTACH, pid, 0, 0);
   if (r < 0) {
-    fprintf(stderr, "could not attach\n");
+    /* the thread exited, not an error */
+    if (errno != ESRCH)
+      fprintf(stderr, "could not attach\n");
     return r;
   }
   
@@ -79,50 +96,143 @@ static int get_thread_list(pid_t pid,
   if (dir == NULL)
     return -1;
   
+  /* a single pass, threads can come and go while it is read */
   count = 0;
-  while ((ent = readdir(dir)) != NULL) {
-    if (ent->d_name[0] != '.')
-      count ++;
-  }
-  
-  thread_count = count;
+  thread_count = 16;
   thread_list = malloc(thread_count * sizeof(* thread_list));
-  
-  rewinddir(dir);
-  count = 0;
   while ((ent = readdir(dir)) != NULL) {
-    if (ent->d_name[0] != '.') {
-      thread_list[count] = strtoul(ent->d_name, NULL, 10);
-      count ++;
+    if (ent->d_name[0] == '.')
+      continue;
+    
+    if (count >= thread_count) {
+      thread_count *= 2;
+      thread_list = realloc(thread_list,
+          thread_count * sizeof(* thread_list));
     }
+    thread_list[count] = strtoul(ent->d_name, NULL, 10);
+    count ++;
   }
   
   closedir(dir);
   
   * p_thread_list = thread_list;
-  * p_thread_count = thread_count;
-
+  * p_thread_count = count;
+  
   return 0;
 }
 
 #define MAX_FRAME 512
+/* user stacks are cut at that depth unless set with -D */
+#define MAX_STACK_DEPTH 4096
+/* the unwind arrays start that big and double as needed */
+#define MIN_STACK_SIZE 64
+
+/*
+  Synthetic frames stand for what is not a code address. They are not
+  canonical addresses: the tag is in the top byte.
+*/
+#define SYNTHETIC_FRAME_SHIFT 56
+/* outermost frame of a stack cut at the maximum depth */
+#define TRUNCATED_FRAME (0xfdUL << SYNTHETIC_FRAME_SHIFT)
+
+/*
+  Links found by the last unwind of a thread. Entry i is the frame
+  pointer read after frame i was pushed, with the saved frame pointer
+  and the return address it held.
+*/
+
+struct unwind_cache {
+  unsigned long * stackframe;
+  unsigned int stackframe_count;
+  unsigned long * fp;
+  unsigned long * saved_fp;
+  unsigned long * ret;
+  unsigned int fp_count;
+};
+
+static void unwind_cache_init(struct unwind_cache * cache)
+{
+  cache->stackframe = NULL;
+  cache->stackframe_count = 0;
+  cache->fp = NULL;
+  cache->saved_fp = NULL;
+  cache->ret = NULL;
+  cache->fp_count = 0;
+}
+
+static void unwind_cache_done(struct unwind_cache * cache)
+{
+  free(cache->stackframe);
+  free(cache->fp);
+  free(cache->saved_fp);
+  free(cache->ret);
+}
+
+/* the arrays keep their content. Returns -1 if memory is exhausted. */
+
+static int grow_unwind_frames(struct unwind_cache * frames,
+    unsigned int * p_size, unsigned int max_depth)
+{
+  unsigned int size;
+  unsigned long * tab;
+  
+  size = * p_size * 2;
+  if (size == 0)
+    size = MIN_STACK_SIZE;
+  if (size > max_depth)
+    size = max_depth;
+  tab = realloc(frames->stackframe, size * sizeof(* tab));
+  if (tab == NULL)
+    return -1;
+  frames->stackframe = tab;
+  tab = realloc(frames->fp, size * sizeof(* tab));
+  if (tab == NULL)
+    return -1;
+  frames->fp = tab;
+  tab = realloc(frames->saved_fp, size * sizeof(* tab));
+  if (tab == NULL)
+    return -1;
+  frames->saved_fp = tab;
+  tab = realloc(frames->ret, size * sizeof(* tab));
+  if (tab == NULL)
+    return -1;
+  frames->ret = tab;
+  * p_size = size;
+  
+  return 0;
+}
+
+/*
+  When a frame pointer still holds the same saved frame pointer and
+  return address as on the previous unwind, the outer frames are
+  assumed unchanged and are copied from the cache instead of being
+  read from the target.
+  A stack deeper than max_depth is cut, TRUNCATED_FRAME is then its
+  outermost frame.
+  Returns -1 if the registers could not be read or memory is exhausted,
+  the cache is then kept.
+*/
 
-static int get_stack(pid_t pid,
+static int get_stack(pid_t pid, struct unwind_cache * cache,
+    unsigned int max_depth,
     unsigned long ** p_stackframe, unsigned int * p_stackframe_count)
 {
   unsigned long pc;
   unsigned long fp;
-  unsigned long stackframe[MAX_FRAME];
-  unsigned int stackframe_count;
+  struct unwind_cache frames;
+  unsigned int size;
+  unsigned int cache_index;
   unsigned long * result;
   
+  errno = 0;
 #ifdef __x86_64
   pc = ptrace(PTRACE_PEEKUSER, pid, RIP, 0);
 #else
   pc = ptrace(PTRACE_PEEKUSER, pid, EIP * 4, 0);
 #endif
   if (errno != 0) {
-    fprintf(stderr, "error peek eip\n");
+    if (errno != ESRCH)
+      fprintf(stderr, "error peek eip\n");
     return -1;
   }
   
@@ -132,16 +242,29 @@ static int get_stack(pid_t pid,
   fp = ptrace(PTRACE_PEEKUSER, pid, EBP * 4, 0);
 #endif
   if (errno != 0) {
-    fprintf(stderr, "error peek ebp\n");
+    if (errno != ESRCH)
+      fprintf(stderr, "error peek ebp\n");
     return -1;
   }
   
-  stackframe_count = 0;
-  while (1) {
+  /* as big as the previous stack */
+  unwind_cache_init(&frames);
+  size = 0;
+  while (size < cache->stackframe_count) {
+    if (grow_unwind_frames(&frames, &size, max_depth) < 0)
+      goto free;
+  }
+  cache_index = 0;
+  while (frames.stackframe_count < max_depth) {
     unsigned long nextfp;
     
-    stackframe[stackframe_count] = pc;
-    stackframe_count ++;
+    if (frames.stackframe_count >= size) {
+      if (grow_unwind_frames(&frames, &size, max_depth) < 0)
+        goto free;
+    }
+    
+    frames.stackframe[frames.stackframe_count] = pc;
+    frames.stackframe_count ++;
     nextfp = ptrace(PTRACE_PEEKDATA, pid, fp, 0);
     if (errno != 0)
       break;
@@ -152,13 +275,119 @@ static int get_stack(pid_t pid,
     pc = ptrace(PTRACE_PEEKDATA, pid, fp + 4, 0);
 #endif
     
-    fp = nextfp;
-    if (fp == 0)
+    frames.fp[frames.fp_count] = fp;
+    frames.saved_fp[frames.fp_count] = nextfp;
+    frames.ret[frames.fp_count] = pc;
+    frames.fp_count ++;
+    
+    /* frame pointers grow toward the outermost frame */
+    while ((cache_index < cache->fp_count) &&
+        (cache->fp[cache_index] < fp))
+      cache_index ++;
+    if ((cache_index < cache->fp_count) &&
+        (cache->fp[cache_index] == fp) &&
+        (cache->saved_fp[cache_index] == nextfp) &&
+        (cache->ret[cache_index] == pc)) {
+      unsigned int i;
+      
+      for(i = cache_index + 1 ; i < cache->stackframe_count ; i ++) {
+        if (frames.stackframe_count >= max_depth)
+          break;
+        if (frames.stackframe_count >= size) {
+          if (grow_unwind_frames(&frames, &size, max_depth) < 0)
+            goto free;
+        }
+        frames.stackframe[frames.stackframe_count] = cache->stackframe[i];
+        frames.stackframe_count ++;
+      }
+      for(i = cache_index + 1 ; i < cache->fp_count ; i ++) {
+        if (frames.fp_count >= max_depth)
+          break;
+        frames.fp[frames.fp_count] = cache->fp[i];
+        frames.saved_fp[frames.fp_count] = cache->saved_fp[i];
+        frames.ret[frames.fp_count] = cache->ret[i];
+        frames.fp_count ++;
+      }
+      break;
+    }
+    
+    if (nextfp == 0)
       break;
+    /* a corrupted frame pointer could loop, the unwind stops after
+       the return address it holds */
+    if (nextfp <= fp)
+      fp = 0;
+    else
+      fp = nextfp;
   }
+  unwind_cache_done(cache);
+  * cache = frames;
   
-  result = malloc(stackframe_count * sizeof(* result));
+  result = malloc((frames.stackframe_count + 1) * sizeof(* result));
+  memcpy(result, frames.stackframe,
+      frames.stackframe_count * sizeof(* result));
+  * p_stackframe_count = frames.stackframe_count;
+  if (frames.stackframe_count >= max_depth) {
+    result[frames.stackframe_count] = TRUNCATED_FRAME;
+    (* p_stackframe_count) ++;
+  }
+  * p_stackframe = result;
+  
+  return 0;
+  
+ free:
+  unwind_cache_done(&frames);
+  return -1;
+}
+
+/*
+  The kernel stack has to be read before the thread is stopped,
+  otherwise it only shows the ptrace stop.
+  Frames are listed as "[<address>] function+0xoffset/0xsize", the
+  address is zero unless kernel pointers are exposed, in which case
+  it is computed back from the function name.
+  Returns -1 with errno set if the file could not be opened.
+*/
+
+static int get_kernel_stack(pid_t pid, pid_t tid,
+    struct etpan_kallsyms * kallsyms,
+    unsigned long ** p_stackframe, unsigned int * p_stackframe_count)
+{
+  char filename[PATH_MAX];
+  char buf[512];
+  FILE * f;
+  unsigned long stackframe[MAX_FRAME];
+  unsigned int stackframe_count;
+  unsigned long * result;
+  
+  snprintf(filename, sizeof(filename), "/proc/%i/task/%i/stack", pid, tid);
+  f = fopen(filename, "r");
+  if (f == NULL)
+    return -1;
+  
+  stackframe_count = 0;
+  while ((stackframe_count < MAX_FRAME) && fgets(buf, sizeof(buf), f)) {
+    unsigned long address;
+    char * p;
+    
+    if ((buf[0] != '[') || (buf[1] != '<'))
+      continue;
+    address = strtoul(buf + 2, &p, 16);
+    p = strchr(p, ' ');
+    if (p == NULL)
+      continue;
+    p ++;
+    if (address == 0)
+      address = etpan_kallsyms_resolve(kallsyms, p);
+    if ((address == 0) || (address == (unsigned long) -1))
+      continue;
+    
+    stackframe[stackframe_count] = address;
+    stackframe_count ++;
+  }
+  fclose(f);
   
+  result = malloc(stackframe_count * sizeof(* result));
   memcpy(result, stackframe, stackframe_count * sizeof(* result));
   
   * p_stackframe = result;
@@ -171,401 +400,4803 @@ struct stackframe_elt {
   unsigned long * stackframe;
   unsigned int stackframe_count;
   unsigned int sample_count;
+  /* CPU time used by the thread between the samples, in ns */
+  unsigned long long cpu_time;
+  /* estimated sample count when the threads are subsampled, and the
+     variance of the estimate */
+  double weight;
+  double weight_variance;
 };
 
-static void sample(pid_t pid, chash * thread_hash)
-{
-  pid_t * tab;
+enum {
+  SAMPLE_ALL_THREADS,
+  /* only the running threads, a CPU profile */
+  SAMPLE_RUNNING_THREADS,
+  /* all the threads, with the ones that are not running aggregated
+     separately */
+  SAMPLE_WALL_CLOCK,
+};
+
+/* pause times, bucket i counts the pauses of [2^i, 2^(i+1)[ us */
+#define PAUSE_BUCKET_COUNT 24
+
+struct pause_histogram {
+  unsigned int bucket[PAUSE_BUCKET_COUNT];
   unsigned int count;
-  unsigned int i;
-  int r;
-  
-  r = attach(pid);
-  if (r < 0)
-    exit(EXIT_FAILURE);
-    
-  r = get_thread_list(pid, &tab, &count);
-  if (r < 0)
-    exit(EXIT_FAILURE);
-    
-  for(i = 0 ; i < count ; i ++) {
-    if (tab[i] != pid)
-      attach_thread(tab[i]);
-  }
-    
-  for(i = 0 ; i < count ; i ++) {
-    unsigned long * stackframe;
-    unsigned int stackframe_count;
-    chashdatum key;
-    chashdatum value;
-    struct stackframe_elt * elt;
-    chash * stack_hash;
-    unsigned int k;
-      
-    r = get_stack(tab[i], &stackframe, &stackframe_count);
-    if (r < 0)
-      exit(EXIT_FAILURE);
-      
-    key.data = &tab[i];
-    key.len = sizeof(tab[i]);
-    r = chash_get(thread_hash, &key, &value);
-    if (r < 0) {
-      stack_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
-      value.data = stack_hash;
-      value.len = 0;
-      chash_set(thread_hash, &key, &value, NULL);
-    }
-    else {
-      stack_hash = value.data;
-    }
-      
-    for(k = 1 ; k <= stackframe_count ; k ++) {
-      key.data = stackframe + (stackframe_count - k);
-      key.len = k * sizeof(* stackframe);
-      r = chash_get(stack_hash, &key, &value);
-      if (r < 0) {
-        elt = malloc(sizeof(* elt));
-        elt->stackframe = malloc(sizeof(* elt->stackframe) * k);
-        memcpy(elt->stackframe, stackframe + (stackframe_count - k),
-            k * sizeof(* stackframe));
-        elt->stackframe_count = k;
-        elt->sample_count = 1;
-        value.data = elt;
-        value.len = 0;
-        chash_set(stack_hash, &key, &value, NULL);
-      }
-      else {
-        elt = value.data;
-        elt->sample_count ++;
-      }
-    }
-  }
-    
-  for(i = 0 ; i < count ; i ++) {
-    if (tab[i] != pid)
-      detach(tab[i]);
-  }
-  detach(pid);
-  free(tab);
-}
+  unsigned long long max;
+};
 
-static int compare_stack(const void * a, const void * b)
-{
-  struct stackframe_elt * const  * p_elt_a;
-  struct stackframe_elt * const * p_elt_b;
-  struct stackframe_elt * elt_a;
-  struct stackframe_elt * elt_b;
-  unsigned int min_stack;
-  unsigned int frame_index;
-  unsigned int offset_a;
-  unsigned int offset_b;
+/* ticks sampled with the same delay */
+struct sample_period {
+  unsigned long long start;
+  unsigned long long end;
+  unsigned int delay;
+  unsigned int tick_count;
+};
+
+/* a sampled process */
+struct target_process {
+  pid_t pid;
+  char comm[32];
+  /* tid -> stack hash */
+  chash * thread_hash;
+  /* off-CPU samples in SAMPLE_WALL_CLOCK mode */
+  chash * offcpu_thread_hash;
+  struct etpan_symbol_table * symtable;
+  /* a frame was outside of the files known to the symbol table */
+  int symtable_stale;
+  /* first tick the symbol table can be read again */
+  unsigned int symtable_refresh_tick;
+  unsigned int symtable_refresh_interval;
+  /* stacks written by the in-process collector */
+  struct etpan_ring * ring;
+  /* struct etpan_perf_event, one per thread and event type */
+  carray * event_list;
+  /* tid -> NULL, threads whose events were opened */
+  chash * event_tid_hash;
+  /* samples lost by the closed events */
+  unsigned long long event_lost;
+  /* one tree per event type, NULL when not sampled */
+  chash * event_thread_hash[ETPAN_PERF_EVENT_COUNT];
+  int exited;
+  /* process whose report includes this one */
+  struct target_process * merged_into;
+};
+
+enum {
+  GROUP_THREADS_NONE,
+  /* threads with the same name */
+  GROUP_THREADS_BY_NAME,
+  /* threads started in the same function */
+  GROUP_THREADS_BY_ROOT,
+  GROUP_THREADS_ALL,
+};
+
+struct sampler {
+  int mode;
+  /* read the stacks from the in-process collector instead of stopping
+     the threads */
+  int preload;
+  /* sample period of each software event, 0 when not sampled */
+  unsigned long event_period[ETPAN_PERF_EVENT_COUNT];
+  int event_count;
+  /* kernel frames of the events, cleared when not allowed */
+  int event_kernel;
+  /* also capture the kernel part of the stacks */
+  int kernel_stack;
+  struct etpan_kallsyms * kallsyms;
+  /* user stacks are cut at that depth */
+  unsigned int max_stack_depth;
+  /* fold the repeated cycles of frames */
+  int fold_recursion;
+  /* reuse the previous stack of threads that did not run */
+  int reuse_idle_stack;
+  /* weight the samples with the CPU time used since the last tick */
+  int cpu_time_weight;
+  /* maximum number of threads of a process stopped per tick, 0 for all */
+  unsigned int max_process_threads;
+  /* delay between the ticks in us */
+  unsigned int sample_delay;
+  /* lower bound of the delay, raised when over the pause budget */
+  unsigned int min_sample_delay;
+  /* struct sample_period, one per delay used */
+  carray * period_list;
   
-  p_elt_a = a;
-  p_elt_b = b;
-  elt_a = * p_elt_a;
-  elt_b = * p_elt_b;
-  min_stack = elt_a->stackframe_count;
-  if (elt_b->stackframe_count < min_stack)
-    min_stack = elt_b->stackframe_count;
-  offset_a = elt_a->stackframe_count - min_stack;
-  offset_b = elt_b->stackframe_count - min_stack;
+  /* target overhead in percent of the time, 0 for a fixed delay */
+  unsigned int max_overhead;
+  /* smoothed cost of a tick in us */
+  double tick_cost;
   
-  frame_index = min_stack - 1;
-  while (1) {
-    if (elt_a->stackframe[offset_a + frame_index] ==
-        elt_b->stackframe[offset_b + frame_index]) {
-      /* do nothing */
-    }
-    else if (elt_a->stackframe[offset_a + frame_index] <
-        elt_b->stackframe[offset_b + frame_index]) {
-      return -1;
-    }
-    else {
-      return 1;
-    }
-    if (frame_index == 0)
-      break;
-    
-    frame_index --;
-  }
+  /* maximum time in us the threads can be stopped in a tick, 0 for
+     no limit */
+  unsigned int pause_budget;
+  /* consecutive ticks over the budget */
+  unsigned int budget_strikes;
+  unsigned int aborted_tick_count;
+  struct pause_histogram pause_histogram;
   
-  if (elt_a->stackframe_count < elt_b->stackframe_count)
-    return -1;
-  else if (elt_a->stackframe_count > elt_b->stackframe_count)
-    return 1;
+  /* the threads stay traced between the ticks, new threads are found
+     with their clone events */
+  int trace_clone;
+  /* tid -> pid of the traced threads, 0 until the process is known */
+  chash * traced_hash;
+  unsigned int rescan_ticks;
   
-  return 0;
-}
+  /* struct target_process */
+  carray * process_list;
+  /* pid -> struct target_process */
+  chash * process_hash;
+  /* also sample the descendants of the processes */
+  int follow_children;
+  /* symbols of each file are loaded once for all the processes */
+  struct etpan_module_cache * module_cache;
+  /* command started by the sampler, 0 once reaped */
+  pid_t launched_pid;
+  /* procfs reads of a tick */
+  struct etpan_batch_read * batch_read;
+  /* threads to sample, NULL for all */
+  struct thread_filter * thread_filter;
+  /* how the trees of the threads are merged in the report */
+  int group_mode;
+  
+  /* the threads of a process were stopped too long in this tick */
+  int tick_over_budget;
+  /* time the processes were stopped in this tick, in us */
+  unsigned long long tick_stop_time;
+  
+  /* tid -> struct thread_state */
+  chash * thread_state_hash;
+  unsigned int tick;
+  /* threads that exited between being listed and being unwound */
+  unsigned int vanished_count;
+  /* exited threads whose samples were moved to EXITED_THREADS */
+  unsigned int retired_count;
+};
 
-static unsigned int common_count(struct stackframe_elt * elt_a,
-    struct stackframe_elt * elt_b)
+/* procfs files read at each tick */
+enum {
+  PROCFS_STAT,
+  PROCFS_SCHEDSTAT,
+  PROCFS_SYSCALL,
+  PROCFS_FILE_COUNT,
+};
+
+struct thread_state {
+  pid_t pid;
+  pid_t tid;
+  /* CPU time in ns when the stack was captured */
+  unsigned long long cpu_time;
+  /* last captured stack, kernel frames included */
+  unsigned long * stackframe;
+  unsigned int stackframe_count;
+  unsigned int reuse_count;
+  struct unwind_cache unwind_cache;
+  /* CPU time in ns at the previous tick, -1 if unknown */
+  unsigned long long tick_cpu_time;
+  /* the thread ran when it was last observed */
+  int active;
+  /* last tick the thread was listed */
+  unsigned int seen_tick;
+  /* procfs files of the thread, kept open between the ticks, -1 if
+     not open */
+  int procfs_fd[PROCFS_FILE_COUNT];
+  /* name of the thread, only read when the threads are grouped by
+     name */
+  char comm[16];
+};
+
+/* samples of the exited threads are aggregated under that tid */
+#define EXITED_THREADS 0
+/* samples of all the threads, when they are merged */
+#define ALL_THREADS -1
+/* states of the exited threads are retired every that many ticks */
+#define RETIRE_TICKS 100
+
+/* unwind anyway after that many reuses */
+#define MAX_STACK_REUSE 100
+/* the ptrace stop itself costs the thread a few microseconds */
+#define IDLE_CPU_TIME (100 * 1000)
+
+/* the sampling rate is halved after that many ticks over the budget */
+#define MAX_BUDGET_STRIKES 3
+#define MIN_SAMPLE_DELAY 1000
+#define MAX_SAMPLE_DELAY (1000 * 1000)
+/* minimum number of ticks between two changes of the delay */
+#define MIN_PERIOD_TICKS 10
+
+static unsigned long long get_time_usec(void)
 {
-  unsigned int min_stack;
-  unsigned int frame_index;
-  unsigned int offset_a;
-  unsigned int offset_b;
+  struct timespec ts;
   
-  min_stack = elt_a->stackframe_count;
-  if (elt_b->stackframe_count < min_stack)
-    min_stack = elt_b->stackframe_count;
-  offset_a = elt_a->stackframe_count - min_stack;
-  offset_b = elt_b->stackframe_count - min_stack;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
   
-  frame_index = min_stack - 1;
-  while (1) {
-    if (elt_a->stackframe[offset_a + frame_index] ==
-        elt_b->stackframe[offset_b + frame_index]) {
-      /* do nothing */
-    }
-    else {
-        return min_stack - 1 - frame_index;
-    }
-    if (frame_index == 0)
-      break;
-    
-    frame_index --;
-  }
+  return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long get_cpu_time_usec(void)
+{
+  struct timespec ts;
   
-  return min_stack;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  
+  return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static void print_stackframe(struct stackframe_elt * elt)
+static void set_sample_delay(struct sampler * sampler, unsigned int delay)
 {
-  unsigned int frame_index;
+  struct sample_period * period;
+  unsigned long long now;
   
-  printf("%u: ", elt->sample_count);
-  frame_index = elt->stackframe_count - 1;
-  while (1) {
-    printf("%p ", (void *) elt->stackframe[frame_index]);
-    if (frame_index == 0)
-      break;
-        
-    frame_index --;
+  if (delay < sampler->min_sample_delay)
+    delay = sampler->min_sample_delay;
+  if (delay > MAX_SAMPLE_DELAY)
+    delay = MAX_SAMPLE_DELAY;
+  
+  now = get_time_usec();
+  if (carray_count(sampler->period_list) > 0) {
+    period = carray_get(sampler->period_list,
+        carray_count(sampler->period_list) - 1);
+    if (delay == period->delay)
+      return;
+    period->end = now;
   }
-  printf("\n");
+  
+  period = malloc(sizeof(* period));
+  period->start = now;
+  period->end = now;
+  period->delay = delay;
+  period->tick_count = 0;
+  carray_add(sampler->period_list, period, NULL);
+  sampler->sample_delay = delay;
 }
 
-struct stackframe_node {
-  struct stackframe_elt * elt;
-  carray * children;
-};
+/*
+  The delay is chosen so that the cost of a tick, the longest of the
+  CPU time used by the sampler and the time the target was stopped,
+  stays under max_overhead percent of the tick period.
+*/
 
-static int compare_sample(const void * a, const void * b)
+static void adjust_sample_delay(struct sampler * sampler,
+    struct sample_period * current, unsigned long long cost)
 {
-  struct stackframe_node * const  * p_elt_a;
-  struct stackframe_node * const * p_elt_b;
-  struct stackframe_node * elt_a;
-  struct stackframe_node * elt_b;
+  double period;
+  double delay;
   
-  p_elt_a = a;
-  p_elt_b = b;
-  elt_a = * p_elt_a;
-  elt_b = * p_elt_b;
+  if (sampler->tick_cost == 0)
+    sampler->tick_cost = cost;
+  else
+    sampler->tick_cost = (sampler->tick_cost * 7 + cost) / 8;
   
-  return elt_b->elt->sample_count - elt_a->elt->sample_count;
+  if (sampler->max_overhead == 0)
+    return;
+  if (current->tick_count < MIN_PERIOD_TICKS)
+    return;
+  
+  period = sampler->tick_cost * 100 / sampler->max_overhead;
+  delay = period - sampler->tick_cost;
+  if (delay < MIN_SAMPLE_DELAY)
+    delay = MIN_SAMPLE_DELAY;
+  
+  /* small changes would only split the periods */
+  if ((delay < sampler->sample_delay * 0.8) ||
+      (delay > sampler->sample_delay * 1.25))
+    set_sample_delay(sampler, (unsigned int) delay);
 }
 
-static void sort_tree(struct stackframe_node * node)
+static void show_sample_periods(struct sampler * sampler)
 {
-  void ** data;
+  unsigned long long origin;
   unsigned int i;
   
-  data = carray_data(node->children);
-  qsort(data, carray_count(node->children), sizeof(* data), compare_sample);
-  for(i = 0 ; i < carray_count(node->children) ; i ++) {
-    struct stackframe_node * child;
+  if (carray_count(sampler->period_list) < 2)
+    return;
+  
+  origin = ((struct sample_period *)
+      carray_get(sampler->period_list, 0))->start;
+  printf("sampling periods:\n");
+  for(i = 0 ; i < carray_count(sampler->period_list) ; i ++) {
+    struct sample_period * period;
+    double duration;
     
-    child = carray_get(node->children, i);
-    sort_tree(child);
+    period = carray_get(sampler->period_list, i);
+    if (period->tick_count == 0)
+      continue;
+    duration = (period->end - period->start) / 1000000.;
+    printf("  %.3f - %.3f s: delay %u us, %u ticks",
+        (period->start - origin) / 1000000.,
+        (period->end - origin) / 1000000.,
+        period->delay, period->tick_count);
+    if (duration > 0)
+      printf(", %.1f ticks/s", period->tick_count / duration);
+    printf("\n");
   }
 }
 
-static const char * my_basename(const char * basename)
+static void pause_histogram_add(struct pause_histogram * histogram,
+    unsigned long long duration)
 {
-  const char * result;
-  const char * p;
+  unsigned int i;
+  
+  i = 0;
+  while ((duration >> (i + 1)) != 0 && (i < PAUSE_BUCKET_COUNT - 1))
+    i ++;
+  histogram->bucket[i] ++;
+  histogram->count ++;
+  if (duration > histogram->max)
+    histogram->max = duration;
+}
+
+static void show_pause_histogram(struct pause_histogram * histogram)
+{
+  unsigned int first;
+  unsigned int last;
+  unsigned int i;
+  
+  if (histogram->count == 0)
+    return;
+  
+  first = 0;
+  while (histogram->bucket[first] == 0)
+    first ++;
+  last = PAUSE_BUCKET_COUNT - 1;
+  while (histogram->bucket[last] == 0)
+    last --;
+  
+  printf("pause times (%u, max %llu us):\n", histogram->count,
+      histogram->max);
+  for(i = first ; i <= last ; i ++) {
+    printf("  %8lu - %8lu us: %u\n", i == 0 ? 0 : 1UL << i,
+        (1UL << (i + 1)) - 1, histogram->bucket[i]);
+  }
+}
+
+struct kernel_stack {
+  unsigned long * stackframe;
+  unsigned int stackframe_count;
+};
+
+static void sample_kernel_stack(struct sampler * sampler,
+    pid_t pid, pid_t tid, struct kernel_stack * kernel_stack)
+{
+  int r;
+  
+  kernel_stack->stackframe = NULL;
+  kernel_stack->stackframe_count = 0;
+  if (!sampler->kernel_stack)
+    return;
+  
+  r = get_kernel_stack(pid, tid, sampler->kallsyms,
+      &kernel_stack->stackframe, &kernel_stack->stackframe_count);
+  /* the thread may have exited, its kernel stack is then empty */
+  if ((r < 0) && ((errno == EACCES) || (errno == EPERM))) {
+    fprintf(stderr, "kernel stacks are not readable, disabled\n");
+    sampler->kernel_stack = 0;
+  }
+}
+
+/* fields of /proc/<pid>/task/<tid>/stat that follow the command name */
+
+static char * parse_thread_stat(char * buf)
+{
+  char * p;
+  
+  /* the command name may contain spaces */
+  p = strrchr(buf, ')');
+  if ((p == NULL) || (p[1] != ' '))
+    return NULL;
+  
+  return p + 2;
+}
+
+/* the command name is between the first '(' and the last ')' */
+
+static void parse_thread_comm(char * buf, char * comm, size_t size)
+{
+  char * begin;
+  char * end;
+  size_t len;
+  
+  begin = strchr(buf, '(');
+  end = strrchr(buf, ')');
+  if ((begin == NULL) || (end == NULL) || (end < begin))
+    return;
+  
+  begin ++;
+  len = end - begin;
+  if (len >= size)
+    len = size - 1;
+  memcpy(comm, begin, len);
+  comm[len] = '\0';
+}
+
+static char * read_thread_stat(pid_t pid, pid_t tid,
+    char * buf, size_t size)
+{
+  char filename[PATH_MAX];
+  FILE * f;
+  char * p;
+  
+  snprintf(filename, sizeof(filename), "/proc/%i/task/%i/stat", pid, tid);
+  f = fopen(filename, "r");
+  if (f == NULL)
+    return NULL;
+  p = fgets(buf, size, f);
+  fclose(f);
+  if (p == NULL)
+    return NULL;
+  
+  return parse_thread_stat(buf);
+}
+
+/*
+  Off-CPU threads get a synthetic leaf frame for the syscall they are
+  blocked in. It is not a canonical address: SYSCALL_FRAME_TAG in the
+  top byte, then the syscall number and the fd or futex address the
+  syscall waits on.
+*/
+
+#define SYSCALL_FRAME_TAG 0xfeUL
+#define SYSCALL_NR_BITS 9
+#define SYSCALL_ARG_BITS 47
+
+enum {
+  SYSCALL_ARG_NONE,
+  SYSCALL_ARG_FD,
+  SYSCALL_ARG_ADDRESS,
+};
+
+/* the fd or address is the first argument */
+static struct {
+  long nr;
+  const char * name;
+  int arg_type;
+} syscall_table[] = {
+#ifdef __x86_64
+  { SYS_read, "read", SYSCALL_ARG_FD },
+  { SYS_write, "write", SYSCALL_ARG_FD },
+  { SYS_pread64, "pread64", SYSCALL_ARG_FD },
+  { SYS_pwrite64, "pwrite64", SYSCALL_ARG_FD },
+  { SYS_readv, "readv", SYSCALL_ARG_FD },
+  { SYS_writev, "writev", SYSCALL_ARG_FD },
+  { SYS_accept, "accept", SYSCALL_ARG_FD },
+  { SYS_accept4, "accept4", SYSCALL_ARG_FD },
+  { SYS_connect, "connect", SYSCALL_ARG_FD },
+  { SYS_recvfrom, "recvfrom", SYSCALL_ARG_FD },
+  { SYS_recvmsg, "recvmsg", SYSCALL_ARG_FD },
+  { SYS_sendto, "sendto", SYSCALL_ARG_FD },
+  { SYS_sendmsg, "sendmsg", SYSCALL_ARG_FD },
+  { SYS_epoll_wait, "epoll_wait", SYSCALL_ARG_FD },
+  { SYS_epoll_pwait, "epoll_pwait", SYSCALL_ARG_FD },
+  { SYS_fsync, "fsync", SYSCALL_ARG_FD },
+  { SYS_fdatasync, "fdatasync", SYSCALL_ARG_FD },
+  { SYS_flock, "flock", SYSCALL_ARG_FD },
+  { SYS_futex, "futex_wait", SYSCALL_ARG_ADDRESS },
+  { SYS_poll, "poll", SYSCALL_ARG_NONE },
+  { SYS_ppoll, "ppoll", SYSCALL_ARG_NONE },
+  { SYS_select, "select", SYSCALL_ARG_NONE },
+  { SYS_pselect6, "pselect6", SYSCALL_ARG_NONE },
+  { SYS_nanosleep, "nanosleep", SYSCALL_ARG_NONE },
+  { SYS_clock_nanosleep, "clock_nanosleep", SYSCALL_ARG_NONE },
+  { SYS_wait4, "wait4", SYSCALL_ARG_NONE },
+  { SYS_waitid, "waitid", SYSCALL_ARG_NONE },
+  { SYS_pause, "pause", SYSCALL_ARG_NONE },
+  { SYS_rt_sigsuspend, "rt_sigsuspend", SYSCALL_ARG_NONE },
+  { SYS_rt_sigtimedwait, "rt_sigtimedwait", SYSCALL_ARG_NONE },
+  { SYS_io_getevents, "io_getevents", SYSCALL_ARG_NONE },
+#endif
+  { -1, NULL, SYSCALL_ARG_NONE },
+};
+
+static int is_syscall_frame(unsigned long frame)
+{
+  return (frame >> (SYSCALL_NR_BITS + SYSCALL_ARG_BITS)) ==
+    SYSCALL_FRAME_TAG;
+}
+
+static int find_syscall(long nr)
+{
+  int i;
+  
+  for(i = 0 ; syscall_table[i].name != NULL ; i ++) {
+    if (syscall_table[i].nr == nr)
+      return i;
+  }
+  
+  return -1;
+}
+
+/*
+  /proc/<pid>/task/<tid>/syscall has the number and arguments of the
+  syscall, "running", or -1 when the thread is not in a syscall.
+  Returns 0 if there is no syscall.
+*/
+
+static unsigned long parse_syscall_frame(char * buf)
+{
+  long nr;
+  unsigned long arg;
+  int index;
+  
+  if (sscanf(buf, "%ld %lx", &nr, &arg) != 2)
+    return 0;
+  if ((nr < 0) || (nr >= (1L << SYSCALL_NR_BITS)))
+    return 0;
+  
+  index = find_syscall(nr);
+  if ((index < 0) || (syscall_table[index].arg_type == SYSCALL_ARG_NONE))
+    arg = 0;
+  arg &= (1UL << SYSCALL_ARG_BITS) - 1;
+  
+  return (SYSCALL_FRAME_TAG << (SYSCALL_NR_BITS + SYSCALL_ARG_BITS)) |
+    ((unsigned long) nr << SYSCALL_ARG_BITS) | arg;
+}
+
+static void print_syscall_frame(unsigned long frame)
+{
+  long nr;
+  unsigned long arg;
+  int index;
+  
+  nr = (frame >> SYSCALL_ARG_BITS) & ((1UL << SYSCALL_NR_BITS) - 1);
+  arg = frame & ((1UL << SYSCALL_ARG_BITS) - 1);
+  index = find_syscall(nr);
+  if (index < 0) {
+    printf("[syscall %li]\n", nr);
+    return;
+  }
+  
+  switch (syscall_table[index].arg_type) {
+  case SYSCALL_ARG_FD:
+    printf("[%s fd=%lu]\n", syscall_table[index].name, arg);
+    break;
+  case SYSCALL_ARG_ADDRESS:
+    printf("[%s %p]\n", syscall_table[index].name, (void *) arg);
+    break;
+  default:
+    printf("[%s]\n", syscall_table[index].name);
+    break;
+  }
+}
+
+/*
+  A cycle of frames repeated in a row is folded to one copy of the
+  cycle, under a synthetic frame with the cycle length and the number
+  of repeats. The repeats are rounded down to a power of two so that
+  the depths of a recursion aggregate to a few nodes.
+*/
+
+#define RECURSION_FRAME_TAG 0xfcUL
+#define MAX_RECURSION_CYCLE 8
+
+static unsigned long get_recursion_frame(unsigned int cycle,
+    unsigned int repeat)
+{
+  unsigned long order;
+  
+  order = 0;
+  while ((repeat >> (order + 1)) != 0)
+    order ++;
+  
+  return (RECURSION_FRAME_TAG << SYNTHETIC_FRAME_SHIFT) |
+    ((unsigned long) cycle << 8) | order;
+}
+
+static int same_frames(unsigned long * stackframe, unsigned int a,
+    unsigned int b, unsigned int count)
+{
+  return memcmp(stackframe + a, stackframe + b,
+      count * sizeof(* stackframe)) == 0;
+}
+
+/* in place, returns the new number of frames */
+
+static unsigned int fold_recursion(unsigned long * stackframe,
+    unsigned int stackframe_count)
+{
+  unsigned int i;
+  unsigned int count;
+  
+  i = 0;
+  count = 0;
+  while (i < stackframe_count) {
+    unsigned int cycle;
+    unsigned int repeat;
+    
+    for(cycle = 1 ; cycle <= MAX_RECURSION_CYCLE ; cycle ++) {
+      if (i + 2 * cycle > stackframe_count)
+        break;
+      if (same_frames(stackframe, i, i + cycle, cycle))
+        break;
+    }
+    if ((cycle > MAX_RECURSION_CYCLE) ||
+        (i + 2 * cycle > stackframe_count)) {
+      stackframe[count] = stackframe[i];
+      count ++;
+      i ++;
+      continue;
+    }
+    
+    repeat = 2;
+    while ((i + (repeat + 1) * cycle <= stackframe_count) &&
+        same_frames(stackframe, i, i + repeat * cycle, cycle))
+      repeat ++;
+    
+    /* the frames are only moved toward the start */
+    memmove(stackframe + count, stackframe + i,
+        cycle * sizeof(* stackframe));
+    count += cycle;
+    stackframe[count] = get_recursion_frame(cycle, repeat);
+    count ++;
+    i += repeat * cycle;
+  }
+  
+  return count;
+}
+
+static int is_synthetic_frame(unsigned long frame)
+{
+  unsigned long tag;
+  
+  tag = frame >> SYNTHETIC_FRAME_SHIFT;
+  
+  return (tag == SYSCALL_FRAME_TAG) || (tag == RECURSION_FRAME_TAG) ||
+    (frame == TRUNCATED_FRAME);
+}
+
+static void print_synthetic_frame(unsigned long frame)
+{
+  unsigned int cycle;
+  unsigned int order;
+  
+  if (frame == TRUNCATED_FRAME) {
+    printf("[truncated]\n");
+    return;
+  }
+  if (is_syscall_frame(frame)) {
+    print_syscall_frame(frame);
+    return;
+  }
+  
+  cycle = (frame >> 8) & 0xff;
+  order = frame & 0xff;
+  if (cycle == 1)
+    printf("[recursion x%u-%u]\n", 1U << order, (2U << order) - 1);
+  else
+    printf("[recursion of %u frames x%u-%u]\n", cycle,
+        1U << order, (2U << order) - 1);
+}
+
+/*
+  Time the thread spent on CPU, from utime + stime of stat, when the
+  kernel does not provide schedstat.
+*/
+
+static int parse_stat_cpu_time(char * p, unsigned long long * p_cpu_time)
+{
+  unsigned long utime;
+  unsigned long stime;
+  int r;
+  
+  r = sscanf(p, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+      &utime, &stime);
+  if (r != 2)
+    return -1;
+  * p_cpu_time = (unsigned long long) (utime + stime) *
+    (1000000000 / sysconf(_SC_CLK_TCK));
+  
+  return 0;
+}
+
+/*
+  Threads can be selected by name, by tid, and among them the ones
+  that used the most CPU. The filtered out threads are never stopped.
+  The selection of a process is updated every second, new threads are
+  matched when they appear and join the top ones at the next update.
+*/
+
+#define THREAD_SELECTION_INTERVAL (1000 * 1000)
+
+struct thread_selection {
+  /* tid -> 1 if the thread is selected, 0 if not */
+  chash * selected_hash;
+  /* tid -> CPU time in ns at the last update */
+  chash * cpu_time_hash;
+  /* in us */
+  unsigned long long update_time;
+};
+
+struct thread_filter {
+  /* glob on the thread name, NULL for any */
+  char * name_pattern;
+  /* regular expression on the thread name */
+  int has_name_regex;
+  regex_t name_regex;
+  /* tid -> NULL, NULL for any */
+  chash * tid_hash;
+  /* number of threads with the highest CPU share, 0 for all */
+  unsigned int top_count;
+  /* pid -> struct thread_selection */
+  chash * selection_hash;
+};
+
+struct thread_cpu_share {
+  pid_t tid;
+  unsigned long long cpu_time;
+};
+
+static struct thread_filter * thread_filter_new(void)
+{
+  struct thread_filter * filter;
+  
+  filter = malloc(sizeof(* filter));
+  filter->name_pattern = NULL;
+  filter->has_name_regex = 0;
+  filter->tid_hash = NULL;
+  filter->top_count = 0;
+  filter->selection_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  
+  return filter;
+}
+
+static void thread_selection_free(struct thread_selection * selection)
+{
+  chash_free(selection->cpu_time_hash);
+  chash_free(selection->selected_hash);
+  free(selection);
+}
+
+static void thread_filter_free(struct thread_filter * filter)
+{
+  chashiter * iter;
+  
+  for(iter = chash_begin(filter->selection_hash) ; iter != NULL ;
+      iter = chash_next(filter->selection_hash, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    thread_selection_free(value.data);
+  }
+  chash_free(filter->selection_hash);
+  if (filter->tid_hash != NULL)
+    chash_free(filter->tid_hash);
+  if (filter->has_name_regex)
+    regfree(&filter->name_regex);
+  free(filter);
+}
+
+/* tid[,tid...] */
+
+static int thread_filter_add_tids(struct thread_filter * filter,
+    char * tid_list)
+{
+  char * p;
+  
+  if (filter->tid_hash == NULL)
+    filter->tid_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  
+  for(p = strtok(tid_list, ",") ; p != NULL ; p = strtok(NULL, ",")) {
+    chashdatum key;
+    chashdatum value;
+    pid_t tid;
+    
+    tid = strtoul(p, NULL, 10);
+    if (tid == 0)
+      return -1;
+    key.data = &tid;
+    key.len = sizeof(tid);
+    value.data = NULL;
+    value.len = 0;
+    chash_set(filter->tid_hash, &key, &value, NULL);
+  }
+  
+  return 0;
+}
+
+static int read_thread_comm(pid_t pid, pid_t tid, char * comm, size_t size)
+{
+  char filename[PATH_MAX];
+  FILE * f;
+  char * p;
+  
+  snprintf(filename, sizeof(filename), "/proc/%i/task/%i/comm", pid, tid);
+  f = fopen(filename, "r");
+  if (f == NULL)
+    return -1;
+  p = fgets(comm, size, f);
+  fclose(f);
+  if (p == NULL)
+    return -1;
+  comm[strcspn(comm, "\n")] = '\0';
+  
+  return 0;
+}
+
+static int read_process_comm(pid_t pid, char * comm, size_t size)
+{
+  return read_thread_comm(pid, pid, comm, size);
+}
+
+static int match_thread(struct thread_filter * filter, pid_t pid, pid_t tid)
+{
+  char comm[32];
+  
+  if (filter->tid_hash != NULL) {
+    chashdatum key;
+    chashdatum value;
+    
+    key.data = &tid;
+    key.len = sizeof(tid);
+    if (chash_get(filter->tid_hash, &key, &value) < 0)
+      return 0;
+  }
+  
+  if ((filter->name_pattern == NULL) && !filter->has_name_regex)
+    return 1;
+  if (read_thread_comm(pid, tid, comm, sizeof(comm)) < 0)
+    return 0;
+  if ((filter->name_pattern != NULL) &&
+      (fnmatch(filter->name_pattern, comm, 0) != 0))
+    return 0;
+  if (filter->has_name_regex &&
+      (regexec(&filter->name_regex, comm, 0, NULL, 0) != 0))
+    return 0;
+  
+  return 1;
+}
+
+static int read_thread_cpu_time(pid_t pid, pid_t tid,
+    unsigned long long * p_cpu_time)
+{
+  char filename[PATH_MAX];
+  char buf[1024];
+  FILE * f;
+  char * p;
+  int r;
+  
+  snprintf(filename, sizeof(filename), "/proc/%i/task/%i/schedstat",
+      pid, tid);
+  f = fopen(filename, "r");
+  if (f != NULL) {
+    r = fscanf(f, "%llu", p_cpu_time);
+    fclose(f);
+    if (r == 1)
+      return 0;
+  }
+  
+  p = read_thread_stat(pid, tid, buf, sizeof(buf));
+  if (p == NULL)
+    return -1;
+  
+  return parse_stat_cpu_time(p, p_cpu_time);
+}
+
+static int compare_cpu_share(const void * a, const void * b)
+{
+  const struct thread_cpu_share * share_a;
+  const struct thread_cpu_share * share_b;
+  
+  share_a = a;
+  share_b = b;
+  if (share_a->cpu_time > share_b->cpu_time)
+    return -1;
+  if (share_a->cpu_time < share_b->cpu_time)
+    return 1;
+  return 0;
+}
+
+/*
+  The CPU share of a thread is its CPU time since the last update, or
+  since it started when it is new.
+*/
+
+static void update_thread_selection(struct thread_filter * filter,
+    struct thread_selection * selection, pid_t pid,
+    pid_t * tab, unsigned int count)
+{
+  struct thread_cpu_share * share_tab;
+  chash * cpu_time_hash;
+  unsigned int share_count;
+  unsigned int i;
+  
+  chash_clear(selection->selected_hash);
+  cpu_time_hash = chash_new(CHASH_DEFAULTSIZE,
+      CHASH_COPYKEY | CHASH_COPYVALUE);
+  share_tab = malloc(count * sizeof(* share_tab));
+  share_count = 0;
+  for(i = 0 ; i < count ; i ++) {
+    chashdatum key;
+    chashdatum value;
+    unsigned long long cpu_time;
+    unsigned long long last_cpu_time;
+    int selected;
+    
+    selected = match_thread(filter, pid, tab[i]);
+    key.data = &tab[i];
+    key.len = sizeof(tab[i]);
+    if (selected && (filter->top_count > 0)) {
+      selected = 0;
+      if (read_thread_cpu_time(pid, tab[i], &cpu_time) == 0) {
+        last_cpu_time = 0;
+        if (chash_get(selection->cpu_time_hash, &key, &value) == 0)
+          memcpy(&last_cpu_time, value.data, sizeof(last_cpu_time));
+        if (last_cpu_time > cpu_time)
+          last_cpu_time = 0;
+        share_tab[share_count].tid = tab[i];
+        share_tab[share_count].cpu_time = cpu_time - last_cpu_time;
+        share_count ++;
+        
+        value.data = &cpu_time;
+        value.len = sizeof(cpu_time);
+        chash_set(cpu_time_hash, &key, &value, NULL);
+      }
+    }
+    value.data = (void *) (long) selected;
+    value.len = 0;
+    chash_set(selection->selected_hash, &key, &value, NULL);
+  }
+  
+  if (filter->top_count > 0) {
+    qsort(share_tab, share_count, sizeof(* share_tab), compare_cpu_share);
+    if (share_count > filter->top_count)
+      share_count = filter->top_count;
+    for(i = 0 ; i < share_count ; i ++) {
+      chashdatum key;
+      chashdatum value;
+      
+      key.data = &share_tab[i].tid;
+      key.len = sizeof(share_tab[i].tid);
+      value.data = (void *) 1L;
+      value.len = 0;
+      chash_set(selection->selected_hash, &key, &value, NULL);
+    }
+  }
+  free(share_tab);
+  
+  /* the exited threads are dropped */
+  chash_free(selection->cpu_time_hash);
+  selection->cpu_time_hash = cpu_time_hash;
+}
+
+static struct thread_selection *
+get_thread_selection(struct thread_filter * filter, pid_t pid)
+{
+  chashdatum key;
+  chashdatum value;
+  struct thread_selection * selection;
+  
+  key.data = &pid;
+  key.len = sizeof(pid);
+  if (chash_get(filter->selection_hash, &key, &value) == 0)
+    return value.data;
+  
+  selection = malloc(sizeof(* selection));
+  selection->selected_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  selection->cpu_time_hash = chash_new(CHASH_DEFAULTSIZE,
+      CHASH_COPYKEY | CHASH_COPYVALUE);
+  selection->update_time = 0;
+  value.data = selection;
+  value.len = 0;
+  chash_set(filter->selection_hash, &key, &value, NULL);
+  
+  return selection;
+}
+
+/* removes the threads that are not selected from the list */
+
+static void filter_thread_list(struct thread_filter * filter, pid_t pid,
+    pid_t * tab, unsigned int * p_count)
+{
+  struct thread_selection * selection;
+  unsigned long long now;
+  unsigned int count;
+  unsigned int i;
+  
+  selection = get_thread_selection(filter, pid);
+  now = get_time_usec();
+  if ((selection->update_time == 0) ||
+      (now - selection->update_time >= THREAD_SELECTION_INTERVAL)) {
+    update_thread_selection(filter, selection, pid, tab, * p_count);
+    selection->update_time = now;
+  }
+  
+  count = 0;
+  for(i = 0 ; i < * p_count ; i ++) {
+    chashdatum key;
+    chashdatum value;
+    int selected;
+    
+    key.data = &tab[i];
+    key.len = sizeof(tab[i]);
+    if (chash_get(selection->selected_hash, &key, &value) == 0) {
+      selected = (int) (long) value.data;
+    }
+    else {
+      selected = (filter->top_count == 0) &&
+        match_thread(filter, pid, tab[i]);
+      value.data = (void *) (long) selected;
+      value.len = 0;
+      chash_set(selection->selected_hash, &key, &value, NULL);
+    }
+    if (!selected)
+      continue;
+    
+    tab[count] = tab[i];
+    count ++;
+  }
+  
+  * p_count = count;
+}
+
+static struct thread_state * get_thread_state(struct sampler * sampler,
+    pid_t pid, pid_t tid)
+{
+  chashdatum key;
+  chashdatum value;
+  struct thread_state * state;
+  int r;
+  int i;
+  
+  key.data = &tid;
+  key.len = sizeof(tid);
+  r = chash_get(sampler->thread_state_hash, &key, &value);
+  if (r == 0)
+    return value.data;
+  
+  state = malloc(sizeof(* state));
+  state->pid = pid;
+  state->tid = tid;
+  state->cpu_time = 0;
+  state->stackframe = NULL;
+  state->stackframe_count = 0;
+  state->reuse_count = 0;
+  unwind_cache_init(&state->unwind_cache);
+  state->tick_cpu_time = (unsigned long long) -1;
+  state->active = 1;
+  state->seen_tick = sampler->tick;
+  for(i = 0 ; i < PROCFS_FILE_COUNT ; i ++)
+    state->procfs_fd[i] = -1;
+  state->comm[0] = '\0';
+  value.data = state;
+  value.len = 0;
+  chash_set(sampler->thread_state_hash, &key, &value, NULL);
+  
+  return state;
+}
+
+static void thread_state_free(struct thread_state * state)
+{
+  int i;
+  
+  for(i = 0 ; i < PROCFS_FILE_COUNT ; i ++) {
+    if (state->procfs_fd[i] >= 0)
+      close(state->procfs_fd[i]);
+  }
+  free(state->stackframe);
+  unwind_cache_done(&state->unwind_cache);
+  free(state);
+}
+
+/*
+  A thread that did not run since its stack was captured still has
+  the same stack, it does not need to be stopped and unwound again.
+*/
+
+static int can_reuse_stack(struct sampler * sampler,
+    struct thread_state * state, int has_cpu_time,
+    unsigned long long cpu_time)
+{
+  if (!sampler->reuse_idle_stack)
+    return 0;
+  if (!has_cpu_time)
+    return 0;
+  
+  if ((state->stackframe == NULL) ||
+      (cpu_time - state->cpu_time >= IDLE_CPU_TIME) ||
+      (state->reuse_count >= MAX_STACK_REUSE)) {
+    state->cpu_time = cpu_time;
+    state->reuse_count = 0;
+    return 0;
+  }
+  
+  state->reuse_count ++;
+  
+  return 1;
+}
+
+static void add_stack_sample(chash * thread_hash, pid_t tid,
+    unsigned long * stackframe, unsigned int stackframe_count,
+    unsigned long long cpu_time, double weight)
+{
+  chashdatum key;
+  chashdatum value;
+  struct stackframe_elt * elt;
+  chash * stack_hash;
+  unsigned int k;
+  int r;
+  
+  key.data = &tid;
+  key.len = sizeof(tid);
+  r = chash_get(thread_hash, &key, &value);
+  if (r < 0) {
+    stack_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+    value.data = stack_hash;
+    value.len = 0;
+    chash_set(thread_hash, &key, &value, NULL);
+  }
+  else {
+    stack_hash = value.data;
+  }
+  
+  for(k = 1 ; k <= stackframe_count ; k ++) {
+    key.data = stackframe + (stackframe_count - k);
+    key.len = k * sizeof(* stackframe);
+    r = chash_get(stack_hash, &key, &value);
+    if (r < 0) {
+      elt = malloc(sizeof(* elt));
+      elt->stackframe = malloc(sizeof(* elt->stackframe) * k);
+      memcpy(elt->stackframe, stackframe + (stackframe_count - k),
+          k * sizeof(* stackframe));
+      elt->stackframe_count = k;
+      elt->sample_count = 1;
+      elt->cpu_time = cpu_time;
+      elt->weight = weight;
+      elt->weight_variance = weight * (weight - 1);
+      value.data = elt;
+      value.len = 0;
+      chash_set(stack_hash, &key, &value, NULL);
+    }
+    else {
+      elt = value.data;
+      elt->sample_count ++;
+      elt->cpu_time += cpu_time;
+      elt->weight += weight;
+      elt->weight_variance += weight * (weight - 1);
+    }
+  }
+}
+
+/* /proc is only read every that many ticks, to check the traced
+   threads and to find the new child processes */
+#define RESCAN_TICKS 100
+
+static void track_thread(struct sampler * sampler, pid_t pid, pid_t tid)
+{
+  chashdatum key;
+  chashdatum value;
+  
+  key.data = &tid;
+  key.len = sizeof(tid);
+  value.data = &pid;
+  value.len = sizeof(pid);
+  chash_set(sampler->traced_hash, &key, &value, NULL);
+}
+
+static void untrack_thread(struct sampler * sampler, pid_t tid)
+{
+  chashdatum key;
+  
+  key.data = &tid;
+  key.len = sizeof(tid);
+  chash_delete(sampler->traced_hash, &key, NULL);
+}
+
+/* pid of a traced thread, -1 if it is not traced */
+
+static pid_t get_tracked_thread_pid(struct sampler * sampler, pid_t tid)
+{
+  chashdatum key;
+  chashdatum value;
+  pid_t pid;
+  
+  key.data = &tid;
+  key.len = sizeof(tid);
+  if (chash_get(sampler->traced_hash, &key, &value) < 0)
+    return -1;
+  memcpy(&pid, value.data, sizeof(pid));
+  
+  return pid;
+}
+
+static void track_clone(struct sampler * sampler, pid_t tid)
+{
+  unsigned long new_tid;
+  pid_t pid;
+  
+  if (ptrace(PTRACE_GETEVENTMSG, tid, 0, &new_tid) < 0)
+    return;
+  pid = get_tracked_thread_pid(sampler, tid);
+  if (pid < 0)
+    pid = 0;
+  track_thread(sampler, pid, new_tid);
+}
+
+static int is_stop_signal(int sig)
+{
+  return (sig == SIGSTOP) || (sig == SIGTSTP) ||
+    (sig == SIGTTIN) || (sig == SIGTTOU);
+}
+
+/*
+  Handles a wait status of a traced thread outside of a sample and
+  lets the thread run again. Signals are delivered as if the thread
+  were not traced.
+*/
+
+static void handle_trace_event(struct sampler * sampler,
+    pid_t tid, int status)
+{
+  int event;
+  int sig;
+  
+  if (WIFEXITED(status) || WIFSIGNALED(status)) {
+    untrack_thread(sampler, tid);
+    return;
+  }
+  if (!WIFSTOPPED(status))
+    return;
+  
+  /* the first stop of a new thread can come before the clone event */
+  if (get_tracked_thread_pid(sampler, tid) < 0)
+    track_thread(sampler, 0, tid);
+  
+  event = status >> 16;
+  sig = WSTOPSIG(status);
+  switch (event) {
+  case 0:
+    /* signal delivery */
+    break;
+  case PTRACE_EVENT_CLONE:
+    track_clone(sampler, tid);
+    sig = 0;
+    break;
+  case PTRACE_EVENT_STOP:
+    /* group stop, the thread stays stopped */
+    if (is_stop_signal(sig)) {
+      ptrace(PTRACE_LISTEN, tid, 0, 0);
+      return;
+    }
+    sig = 0;
+    break;
+  default:
+    sig = 0;
+    break;
+  }
+  ptrace(PTRACE_CONT, tid, 0, sig);
+}
+
+static void drain_trace_events(struct sampler * sampler)
+{
+  pid_t tid;
+  int status;
+  
+  while ((tid = waitpid(-1, &status, __WALL | WNOHANG)) > 0)
+    handle_trace_event(sampler, tid, status);
+}
+
+static void trace_new_threads(struct sampler * sampler, pid_t pid)
+{
+  pid_t * tab;
+  unsigned int count;
+  unsigned int i;
+  chashiter * iter;
+  chash * present_hash;
+  int r;
+  
+  r = get_thread_list(pid, &tab, &count);
+  if (r < 0)
+    return;
+  
+  present_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  for(i = 0 ; i < count ; i ++) {
+    chashdatum key;
+    chashdatum value;
+    
+    key.data = &tab[i];
+    key.len = sizeof(tab[i]);
+    value.data = NULL;
+    value.len = 0;
+    chash_set(present_hash, &key, &value, NULL);
+    
+    switch (get_tracked_thread_pid(sampler, tab[i])) {
+    case -1:
+      r = ptrace(PTRACE_SEIZE, tab[i], 0,
+          PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXIT);
+      if (r == 0)
+        track_thread(sampler, pid, tab[i]);
+      break;
+    case 0:
+      track_thread(sampler, pid, tab[i]);
+      break;
+    }
+  }
+  
+  /* threads that exited without being noticed */
+  iter = chash_begin(sampler->traced_hash);
+  while (iter != NULL) {
+    chashdatum key;
+    chashdatum value;
+    pid_t tid;
+    pid_t tid_pid;
+    
+    chash_key(iter, &key);
+    chash_value(iter, &value);
+    memcpy(&tid, key.data, sizeof(tid));
+    memcpy(&tid_pid, value.data, sizeof(tid_pid));
+    iter = chash_next(sampler->traced_hash, iter);
+    if (tid_pid != pid)
+      continue;
+    if (chash_get(present_hash, &key, &value) < 0)
+      untrack_thread(sampler, tid);
+  }
+  
+  chash_free(present_hash);
+  free(tab);
+}
+
+static int get_traced_thread_list(struct sampler * sampler, pid_t pid,
+    pid_t ** p_thread_list, unsigned int * p_thread_count)
+{
+  pid_t * thread_list;
+  unsigned int count;
+  chashiter * iter;
+  
+  thread_list = malloc((chash_count(sampler->traced_hash) + 1) *
+      sizeof(* thread_list));
+  count = 0;
+  for(iter = chash_begin(sampler->traced_hash) ; iter != NULL ;
+      iter = chash_next(sampler->traced_hash, iter)) {
+    chashdatum key;
+    chashdatum value;
+    pid_t tid_pid;
+    
+    chash_key(iter, &key);
+    chash_value(iter, &value);
+    memcpy(&tid_pid, value.data, sizeof(tid_pid));
+    if (tid_pid != pid)
+      continue;
+    memcpy(&thread_list[count], key.data, sizeof(* thread_list));
+    count ++;
+  }
+  
+  * p_thread_list = thread_list;
+  * p_thread_count = count;
+  
+  return 0;
+}
+
+/*
+  Stops a traced thread. The signal to deliver when the thread is
+  resumed is returned in p_signal, -1 when the thread was in a group
+  stop.
+*/
+
+static int interrupt_thread(struct sampler * sampler, pid_t tid,
+    int * p_signal)
+{
+  int status;
+  int event;
+  int sig;
+  pid_t r;
+  
+  if (ptrace(PTRACE_INTERRUPT, tid, 0, 0) < 0) {
+    untrack_thread(sampler, tid);
+    return -1;
+  }
+  
+  r = waitpid(tid, &status, __WALL);
+  if ((r < 0) || !WIFSTOPPED(status)) {
+    untrack_thread(sampler, tid);
+    return -1;
+  }
+  
+  event = status >> 16;
+  sig = WSTOPSIG(status);
+  switch (event) {
+  case 0:
+    break;
+  case PTRACE_EVENT_CLONE:
+    track_clone(sampler, tid);
+    sig = 0;
+    break;
+  case PTRACE_EVENT_STOP:
+    sig = is_stop_signal(sig) ? -1 : 0;
+    break;
+  default:
+    sig = 0;
+    break;
+  }
+  * p_signal = sig;
+  
+  return 0;
+}
+
+static void resume_thread(pid_t tid, int sig)
+{
+  if (sig < 0)
+    ptrace(PTRACE_LISTEN, tid, 0, 0);
+  else
+    ptrace(PTRACE_CONT, tid, 0, sig);
+}
+
+/*
+  Interrupting a thread can untrack it or track its clones, the tids
+  are copied first. The clones found on a pass are detached on the
+  next one.
+*/
+
+static void untrace_threads(struct sampler * sampler)
+{
+  drain_trace_events(sampler);
+  while (chash_count(sampler->traced_hash) > 0) {
+    pid_t * tab;
+    unsigned int count;
+    unsigned int i;
+    chashiter * iter;
+    
+    tab = malloc(chash_count(sampler->traced_hash) * sizeof(* tab));
+    count = 0;
+    for(iter = chash_begin(sampler->traced_hash) ; iter != NULL ;
+        iter = chash_next(sampler->traced_hash, iter)) {
+      chashdatum key;
+      
+      chash_key(iter, &key);
+      memcpy(&tab[count], key.data, sizeof(* tab));
+      count ++;
+    }
+    
+    for(i = 0 ; i < count ; i ++) {
+      int sig;
+      
+      if (get_tracked_thread_pid(sampler, tab[i]) < 0)
+        continue;
+      if (interrupt_thread(sampler, tab[i], &sig) == 0)
+        ptrace(PTRACE_DETACH, tab[i], 0, sig < 0 ? 0 : sig);
+      untrack_thread(sampler, tab[i]);
+    }
+    free(tab);
+  }
+}
+
+static void stack_hash_free(chash * stack_hash)
+{
+  chashiter * iter;
+  
+  for(iter = chash_begin(stack_hash) ; iter != NULL ;
+      iter = chash_next(stack_hash, iter)) {
+    chashdatum value;
+    struct stackframe_elt * elt;
+    
+    chash_value(iter, &value);
+    elt = value.data;
+    free(elt->stackframe);
+    free(elt);
+  }
+  chash_free(stack_hash);
+}
+
+static void stackframe_elt_add(struct stackframe_elt * elt,
+    struct stackframe_elt * other)
+{
+  elt->sample_count += other->sample_count;
+  elt->cpu_time += other->cpu_time;
+  elt->weight += other->weight;
+  elt->weight_variance += other->weight_variance;
+}
+
+/* the elements of src are moved to dest, src is freed */
+
+static void stack_hash_merge(chash * dest, chash * src)
+{
+  chashiter * iter;
+  
+  for(iter = chash_begin(src) ; iter != NULL ;
+      iter = chash_next(src, iter)) {
+    chashdatum key;
+    chashdatum value;
+    struct stackframe_elt * elt;
+    int r;
+    
+    chash_value(iter, &value);
+    elt = value.data;
+    key.data = elt->stackframe;
+    key.len = elt->stackframe_count * sizeof(* elt->stackframe);
+    r = chash_get(dest, &key, &value);
+    if (r == 0) {
+      stackframe_elt_add(value.data, elt);
+      free(elt->stackframe);
+      free(elt);
+    }
+    else {
+      value.data = elt;
+      value.len = 0;
+      chash_set(dest, &key, &value, NULL);
+    }
+  }
+  chash_free(src);
+}
+
+static void retire_thread_samples(chash * thread_hash, pid_t tid)
+{
+  chashdatum key;
+  chashdatum value;
+  chash * stack_hash;
+  pid_t exited_tid;
+  int r;
+  
+  if (thread_hash == NULL)
+    return;
+  
+  key.data = &tid;
+  key.len = sizeof(tid);
+  r = chash_get(thread_hash, &key, &value);
+  if (r < 0)
+    return;
+  stack_hash = value.data;
+  chash_delete(thread_hash, &key, NULL);
+  
+  exited_tid = EXITED_THREADS;
+  key.data = &exited_tid;
+  key.len = sizeof(exited_tid);
+  r = chash_get(thread_hash, &key, &value);
+  if (r < 0) {
+    value.data = stack_hash;
+    value.len = 0;
+    chash_set(thread_hash, &key, &value, NULL);
+    return;
+  }
+  stack_hash_merge(value.data, stack_hash);
+}
+
+/*
+  The states of the threads that were not listed recently are freed
+  and their samples are aggregated with the ones of the other exited
+  threads, so that memory does not grow with the number of threads
+  ever created.
+*/
+
+static void retire_exited_threads(struct sampler * sampler)
+{
+  chashiter * iter;
+  
+  iter = chash_begin(sampler->thread_state_hash);
+  while (iter != NULL) {
+    chashdatum key;
+    chashdatum value;
+    struct thread_state * state;
+    struct target_process * process;
+    
+    chash_key(iter, &key);
+    chash_value(iter, &value);
+    iter = chash_next(sampler->thread_state_hash, iter);
+    
+    state = value.data;
+    if (sampler->tick - state->seen_tick < RETIRE_TICKS)
+      continue;
+    
+    key.data = &state->pid;
+    key.len = sizeof(state->pid);
+    if (chash_get(sampler->process_hash, &key, &value) < 0)
+      continue;
+    process = value.data;
+    if (process->exited)
+      continue;
+    
+    retire_thread_samples(process->thread_hash, state->tid);
+    retire_thread_samples(process->offcpu_thread_hash, state->tid);
+    key.data = &state->tid;
+    key.len = sizeof(state->tid);
+    chash_delete(sampler->thread_state_hash, &key, NULL);
+    thread_state_free(state);
+    sampler->retired_count ++;
+  }
+}
+
+struct thread_sample {
+  struct thread_state * state;
+  int attached;
+  struct kernel_stack kernel_stack;
+  /* where the sample is aggregated, NULL when the thread is skipped */
+  chash * thread_hash;
+  /* CPU time used since the previous tick */
+  unsigned long long cpu_time_delta;
+  /* inverse of the probability of the thread to be sampled */
+  double weight;
+  /* when the thread was stopped, in us */
+  unsigned long long attach_time;
+  /* signal to deliver on resume when the threads are traced */
+  int resume_signal;
+  /* syscall the thread is blocked in, 0 if unknown */
+  unsigned long syscall_frame;
+  /* scheduler state, 'R' when running or runnable, 0 if unknown */
+  char run_state;
+  int has_cpu_time;
+  /* CPU time in ns */
+  unsigned long long cpu_time;
+};
+
+/*
+  Threads are grouped by the hash they are aggregated to and by
+  whether they ran when they were last observed. Each group gets a
+  share of max_process_threads proportional to its size, and the groups
+  left out get one thread, largest first, while the budget allows it.
+  The threads of a group are picked at random. Samples are weighted
+  with the inverse of the probability of the thread to be picked, so
+  that the estimated counts are unbiased. The cap applies to each
+  process separately.
+*/
+
+#define STRATA_COUNT 4
+
+static void subsample_threads(struct sampler * sampler,
+    struct target_process * process,
+    struct thread_sample * thread_tab, unsigned int count)
+{
+  unsigned int * strata[STRATA_COUNT];
+  unsigned int strata_size[STRATA_COUNT];
+  unsigned int strata_picked[STRATA_COUNT];
+  unsigned int total;
+  unsigned int picked;
+  unsigned int i;
+  unsigned int h;
+  
+  total = 0;
+  for(h = 0 ; h < STRATA_COUNT ; h ++) {
+    strata[h] = malloc(count * sizeof(* strata[h]));
+    strata_size[h] = 0;
+  }
+  for(i = 0 ; i < count ; i ++) {
+    struct thread_sample * thread;
+    
+    thread = &thread_tab[i];
+    if (thread->thread_hash == NULL)
+      continue;
+    
+    h = thread->state->active;
+    if (thread->thread_hash == process->offcpu_thread_hash)
+      h += 2;
+    strata[h][strata_size[h]] = i;
+    strata_size[h] ++;
+    total ++;
+  }
+  
+  if (total <= sampler->max_process_threads)
+    goto free;
+  
+  picked = 0;
+  for(h = 0 ; h < STRATA_COUNT ; h ++) {
+    strata_picked[h] = (unsigned long long) sampler->max_process_threads *
+      strata_size[h] / total;
+    picked += strata_picked[h];
+  }
+  /* one thread for the strata left out, largest first, while the
+     budget allows it */
+  while (picked < sampler->max_process_threads) {
+    unsigned int largest;
+    
+    largest = STRATA_COUNT;
+    for(h = 0 ; h < STRATA_COUNT ; h ++) {
+      if ((strata_picked[h] > 0) || (strata_size[h] == 0))
+        continue;
+      if ((largest == STRATA_COUNT) ||
+          (strata_size[h] > strata_size[largest]))
+        largest = h;
+    }
+    if (largest == STRATA_COUNT)
+      break;
+    strata_picked[largest] = 1;
+    picked ++;
+  }
+  for(h = 0 ; (h < STRATA_COUNT) &&
+        (picked < sampler->max_process_threads) ; h ++) {
+    while ((strata_picked[h] < strata_size[h]) &&
+        (picked < sampler->max_process_threads)) {
+      strata_picked[h] ++;
+      picked ++;
+    }
+  }
+  
+  for(h = 0 ; h < STRATA_COUNT ; h ++) {
+    double weight;
+    
+    if (strata_size[h] == 0)
+      continue;
+    if (strata_picked[h] == 0) {
+      for(i = 0 ; i < strata_size[h] ; i ++)
+        thread_tab[strata[h][i]].thread_hash = NULL;
+      continue;
+    }
+    
+    /* the first picked entries are a random subset */
+    for(i = 0 ; i < strata_picked[h] ; i ++) {
+      unsigned int j;
+      unsigned int tmp;
+      
+      j = i + (unsigned int) (random() % (strata_size[h] - i));
+      tmp = strata[h][i];
+      strata[h][i] = strata[h][j];
+      strata[h][j] = tmp;
+    }
+    
+    weight = (double) strata_size[h] / strata_picked[h];
+    for(i = 0 ; i < strata_size[h] ; i ++) {
+      struct thread_sample * thread;
+      
+      thread = &thread_tab[strata[h][i]];
+      if (i < strata_picked[h])
+        thread->weight = weight;
+      else
+        thread->thread_hash = NULL;
+    }
+  }
+  
+ free:
+  for(h = 0 ; h < STRATA_COUNT ; h ++)
+    free(strata[h]);
+}
+
+static const char * procfs_file_name[PROCFS_FILE_COUNT] = {
+  "stat",
+  "schedstat",
+  "syscall",
+};
+
+/* buffers of the reads of a thread */
+struct procfs_read {
+  int index[PROCFS_FILE_COUNT];
+  char stat[1024];
+  char schedstat[128];
+  char syscall[256];
+};
+
+static int get_procfs_fd(struct thread_state * state, int file)
+{
+  char filename[PATH_MAX];
+  
+  if (state->procfs_fd[file] < 0) {
+    snprintf(filename, sizeof(filename), "/proc/%i/task/%i/%s",
+        state->pid, state->tid, procfs_file_name[file]);
+    state->procfs_fd[file] = open(filename, O_RDONLY | O_CLOEXEC);
+  }
+  
+  return state->procfs_fd[file];
+}
+
+/* up to three files are kept open for each thread */
+
+static void raise_fd_limit(void)
+{
+  struct rlimit limit;
+  
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+    return;
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+/* the file was read when it could not be queued */
+#define PROCFS_READ_DONE -2
+
+/*
+  Returns the index of the read in the batch, PROCFS_READ_DONE or -1 if
+  the file could not be read.
+*/
+
+static int add_procfs_read(struct sampler * sampler,
+    struct thread_state * state, int file, char * buf, size_t size)
+{
+  ssize_t r;
+  int index;
+  int fd;
+  
+  fd = get_procfs_fd(state, file);
+  if (fd < 0)
+    return -1;
+  
+  index = etpan_batch_read_add(sampler->batch_read, fd, buf, size - 1);
+  if (index >= 0)
+    return index;
+  
+  r = pread(fd, buf, size - 1, 0);
+  if (r <= 0) {
+    close(state->procfs_fd[file]);
+    state->procfs_fd[file] = -1;
+    return -1;
+  }
+  buf[r] = '\0';
+  
+  return PROCFS_READ_DONE;
+}
+
+/*
+  Returns NULL if the file could not be read. The fd is then reopened
+  at the next tick: the thread may have exited and its tid been
+  reused.
+*/
+
+static char * get_procfs_read(struct sampler * sampler,
+    struct thread_state * state, int file, int index, char * buf)
+{
+  ssize_t r;
+  
+  if (index == PROCFS_READ_DONE)
+    return buf;
+  if (index < 0)
+    return NULL;
+  
+  r = etpan_batch_read_result(sampler->batch_read, index);
+  if (r <= 0) {
+    close(state->procfs_fd[file]);
+    state->procfs_fd[file] = -1;
+    return NULL;
+  }
+  buf[r] = '\0';
+  
+  return buf;
+}
+
+/*
+  The procfs files of all the threads are read in one batch before
+  any thread is stopped.
+*/
+
+static void read_thread_procfs(struct sampler * sampler,
+    struct thread_sample * thread_tab, unsigned int count)
+{
+  struct procfs_read * read_tab;
+  int need_cpu_time;
+  int need_comm;
+  unsigned int i;
+  
+  need_cpu_time = sampler->reuse_idle_stack || sampler->cpu_time_weight ||
+    (sampler->max_process_threads > 0);
+  /* the name can change, the last one is kept */
+  need_comm = (sampler->group_mode == GROUP_THREADS_BY_NAME);
+  if ((sampler->mode == SAMPLE_ALL_THREADS) && !need_cpu_time &&
+      !need_comm)
+    return;
+  
+  read_tab = malloc(count * sizeof(* read_tab));
+  for(i = 0 ; i < count ; i ++) {
+    struct thread_state * state;
+    struct procfs_read * read;
+    int need_stat;
+    
+    state = thread_tab[i].state;
+    read = &read_tab[i];
+    read->index[PROCFS_STAT] = -1;
+    read->index[PROCFS_SCHEDSTAT] = -1;
+    read->index[PROCFS_SYSCALL] = -1;
+    
+    need_stat = (sampler->mode != SAMPLE_ALL_THREADS) || need_comm;
+    if (need_cpu_time) {
+      read->index[PROCFS_SCHEDSTAT] = add_procfs_read(sampler, state,
+          PROCFS_SCHEDSTAT, read->schedstat, sizeof(read->schedstat));
+      if (read->index[PROCFS_SCHEDSTAT] == -1)
+        need_stat = 1;
+    }
+    if (need_stat) {
+      read->index[PROCFS_STAT] = add_procfs_read(sampler, state,
+          PROCFS_STAT, read->stat, sizeof(read->stat));
+    }
+    /* running threads have no syscall */
+    if (sampler->mode == SAMPLE_WALL_CLOCK) {
+      read->index[PROCFS_SYSCALL] = add_procfs_read(sampler, state,
+          PROCFS_SYSCALL, read->syscall, sizeof(read->syscall));
+    }
+  }
+  
+  etpan_batch_read_run(sampler->batch_read);
+  
+  for(i = 0 ; i < count ; i ++) {
+    struct thread_sample * thread;
+    struct thread_state * state;
+    struct procfs_read * read;
+    char * stat;
+    char * schedstat;
+    char * syscall;
+    
+    thread = &thread_tab[i];
+    state = thread->state;
+    read = &read_tab[i];
+    stat = get_procfs_read(sampler, state, PROCFS_STAT,
+        read->index[PROCFS_STAT], read->stat);
+    if ((stat != NULL) && need_comm)
+      parse_thread_comm(stat, state->comm, sizeof(state->comm));
+    if (stat != NULL)
+      stat = parse_thread_stat(stat);
+    schedstat = get_procfs_read(sampler, state, PROCFS_SCHEDSTAT,
+        read->index[PROCFS_SCHEDSTAT], read->schedstat);
+    syscall = get_procfs_read(sampler, state, PROCFS_SYSCALL,
+        read->index[PROCFS_SYSCALL], read->syscall);
+    
+    if (stat != NULL)
+      thread->run_state = * stat;
+    if (schedstat != NULL)
+      thread->has_cpu_time = (sscanf(schedstat, "%llu",
+                                  &thread->cpu_time) == 1);
+    else if ((stat != NULL) && need_cpu_time)
+      thread->has_cpu_time = (parse_stat_cpu_time(stat,
+                                  &thread->cpu_time) == 0);
+    if (syscall != NULL)
+      thread->syscall_frame = parse_syscall_frame(syscall);
+  }
+  etpan_batch_read_clear(sampler->batch_read);
+  free(read_tab);
+}
+
+/* a library may have been loaded since the table was read */
+
+static void check_symtable(struct target_process * process,
+    unsigned long * stackframe, unsigned int stackframe_count)
+{
+  unsigned int i;
+  
+  if (process->symtable_stale)
+    return;
+  
+  for(i = 0 ; i < stackframe_count ; i ++) {
+    if (is_synthetic_frame(stackframe[i]))
+      continue;
+    if (!etpan_symbol_table_has_address(process->symtable,
+            (void *) stackframe[i])) {
+      process->symtable_stale = 1;
+      break;
+    }
+  }
+}
+
+/*
+  Returns -1 when the process is gone.
+*/
+
+static int sample(struct sampler * sampler, struct target_process * process)
+{
+  pid_t pid;
+  pid_t * tab;
+  unsigned int count;
+  unsigned int i;
+  struct thread_sample * thread_tab;
+  unsigned long long tick_start;
+  int over_budget;
+  int r;
+  
+  pid = process->pid;
+  if (sampler->trace_clone)
+    r = get_traced_thread_list(sampler, pid, &tab, &count);
+  else
+    r = get_thread_list(pid, &tab, &count);
+  if (r < 0)
+    return -1;
+  if ((count == 0) && (kill(pid, 0) < 0)) {
+    free(tab);
+    return -1;
+  }
+  if (sampler->thread_filter != NULL)
+    filter_thread_list(sampler->thread_filter, pid, tab, &count);
+  
+  thread_tab = malloc(count * sizeof(* thread_tab));
+  for(i = 0 ; i < count ; i ++) {
+    struct thread_sample * thread;
+    
+    thread = &thread_tab[i];
+    thread->state = get_thread_state(sampler, pid, tab[i]);
+    thread->state->seen_tick = sampler->tick;
+    thread->attached = 0;
+    thread->kernel_stack.stackframe = NULL;
+    thread->kernel_stack.stackframe_count = 0;
+    thread->thread_hash = process->thread_hash;
+    thread->cpu_time_delta = 0;
+    thread->weight = 1;
+    thread->syscall_frame = 0;
+    thread->run_state = '\0';
+    thread->has_cpu_time = 0;
+    thread->cpu_time = 0;
+  }
+  
+  read_thread_procfs(sampler, thread_tab, count);
+  
+  if (sampler->mode != SAMPLE_ALL_THREADS) {
+    for(i = 0 ; i < count ; i ++) {
+      if (thread_tab[i].run_state == 'R') {
+        thread_tab[i].syscall_frame = 0;
+        continue;
+      }
+      
+      if (sampler->mode == SAMPLE_RUNNING_THREADS)
+        thread_tab[i].thread_hash = NULL;
+      else
+        thread_tab[i].thread_hash = process->offcpu_thread_hash;
+    }
+  }
+  
+  if (sampler->max_process_threads > 0)
+    subsample_threads(sampler, process, thread_tab, count);
+  
+  tick_start = get_time_usec();
+  over_budget = 0;
+  
+  for(i = 0 ; i < count ; i ++) {
+    struct thread_sample * thread;
+    unsigned long long cpu_time;
+    
+    thread = &thread_tab[i];
+    if (thread->thread_hash == NULL)
+      continue;
+    
+    cpu_time = thread->cpu_time;
+    if (thread->has_cpu_time) {
+      struct thread_state * state;
+      
+      /* when the threads are subsampled, the delta is since the
+         thread was last picked */
+      state = thread->state;
+      if ((state->tick_cpu_time != (unsigned long long) -1) &&
+          (cpu_time > state->tick_cpu_time)) {
+        thread->cpu_time_delta = cpu_time - state->tick_cpu_time;
+        state->active = (thread->cpu_time_delta >= IDLE_CPU_TIME);
+      }
+      else if (state->tick_cpu_time != (unsigned long long) -1) {
+        state->active = 0;
+      }
+      state->tick_cpu_time = cpu_time;
+    }
+    
+    if (can_reuse_stack(sampler, thread->state, thread->has_cpu_time,
+            cpu_time))
+      continue;
+    
+    /* the remaining threads are not stopped */
+    if ((sampler->pause_budget > 0) &&
+        (get_time_usec() - tick_start > sampler->pause_budget))
+      over_budget = 1;
+    if (over_budget) {
+      thread->thread_hash = NULL;
+      continue;
+    }
+    
+    /* before the thread is stopped */
+    sample_kernel_stack(sampler, pid, tab[i], &thread->kernel_stack);
+    
+    thread->attach_time = get_time_usec();
+    if (sampler->trace_clone) {
+      r = interrupt_thread(sampler, tab[i], &thread->resume_signal);
+    }
+    else if (tab[i] == pid) {
+      r = attach(pid);
+    }
+    else {
+      r = attach_thread(tab[i]);
+    }
+    if (r < 0) {
+      sampler->vanished_count ++;
+      free(thread->kernel_stack.stackframe);
+      thread->thread_hash = NULL;
+      continue;
+    }
+    thread->attached = 1;
+  }
+  
+  for(i = 0 ; i < count ; i ++) {
+    struct thread_sample * thread;
+    unsigned long * stackframe;
+    unsigned int stackframe_count;
+    
+    thread = &thread_tab[i];
+    if (thread->thread_hash == NULL)
+      continue;
+    if (!thread->attached) {
+      add_stack_sample(thread->thread_hash, tab[i],
+          thread->state->stackframe, thread->state->stackframe_count,
+          thread->cpu_time_delta, thread->weight);
+      continue;
+    }
+    
+    /* the remaining threads are resumed without being unwound */
+    if ((sampler->pause_budget > 0) &&
+        (get_time_usec() - tick_start > sampler->pause_budget))
+      over_budget = 1;
+    if (over_budget) {
+      free(thread->kernel_stack.stackframe);
+      continue;
+    }
+    
+    r = get_stack(tab[i], &thread->state->unwind_cache,
+        sampler->max_stack_depth, &stackframe, &stackframe_count);
+    if (r < 0) {
+      sampler->vanished_count ++;
+      free(thread->kernel_stack.stackframe);
+      continue;
+    }
+    
+    if ((thread->kernel_stack.stackframe_count > 0) ||
+        (thread->syscall_frame != 0)) {
+      unsigned long * full_stackframe;
+      unsigned int kernel_count;
+      unsigned int leaf_count;
+      
+      /* the syscall and kernel frames are leaf frames of the user
+         stack */
+      kernel_count = thread->kernel_stack.stackframe_count;
+      leaf_count = kernel_count;
+      if (thread->syscall_frame != 0)
+        leaf_count ++;
+      full_stackframe = malloc((leaf_count + stackframe_count) *
+          sizeof(* full_stackframe));
+      if (thread->syscall_frame != 0)
+        full_stackframe[0] = thread->syscall_frame;
+      memcpy(full_stackframe + leaf_count - kernel_count,
+          thread->kernel_stack.stackframe,
+          kernel_count * sizeof(* full_stackframe));
+      memcpy(full_stackframe + leaf_count, stackframe,
+          stackframe_count * sizeof(* full_stackframe));
+      free(stackframe);
+      stackframe = full_stackframe;
+      stackframe_count += leaf_count;
+    }
+    free(thread->kernel_stack.stackframe);
+    
+    check_symtable(process, stackframe, stackframe_count);
+    if (sampler->fold_recursion)
+      stackframe_count = fold_recursion(stackframe, stackframe_count);
+    
+    add_stack_sample(thread->thread_hash, tab[i],
+        stackframe, stackframe_count, thread->cpu_time_delta,
+        thread->weight);
+    
+    free(thread->state->stackframe);
+    thread->state->stackframe = stackframe;
+    thread->state->stackframe_count = stackframe_count;
+  }
+  
+  for(i = 0 ; i < count ; i ++) {
+    if (thread_tab[i].attached && sampler->trace_clone) {
+      resume_thread(tab[i], thread_tab[i].resume_signal);
+      pause_histogram_add(&sampler->pause_histogram,
+          get_time_usec() - thread_tab[i].attach_time);
+    }
+    else if (thread_tab[i].attached && (tab[i] != pid)) {
+      detach(tab[i]);
+      pause_histogram_add(&sampler->pause_histogram,
+          get_time_usec() - thread_tab[i].attach_time);
+    }
+  }
+  for(i = 0 ; i < count ; i ++) {
+    if (thread_tab[i].attached && !sampler->trace_clone &&
+        (tab[i] == pid)) {
+      detach(pid);
+      pause_histogram_add(&sampler->pause_histogram,
+          get_time_usec() - thread_tab[i].attach_time);
+    }
+  }
+  free(thread_tab);
+  free(tab);
+  
+  sampler->tick_stop_time += get_time_usec() - tick_start;
+  if (over_budget)
+    sampler->tick_over_budget = 1;
+  
+  return 0;
+}
+
+/* minimum number of ticks between two reads of the mappings */
+#define SYMTABLE_REFRESH_TICKS 10
+#define MAX_SYMTABLE_REFRESH_TICKS 1000
+
+/*
+  Adds the stacks written by the collector since the last tick, each
+  of them for one interval of CPU time. The ring is looked for until
+  the collector has created it.
+  Returns -1 when the process is gone.
+*/
+
+static int read_ring(struct sampler * sampler,
+    struct target_process * process)
+{
+  struct etpan_ring_record record;
+  unsigned long long cpu_time;
+  int exited;
+  
+  /* the last stacks are read after the exit */
+  exited = (kill(process->pid, 0) < 0);
+  if (process->ring == NULL) {
+    if (exited)
+      return -1;
+    process->ring = etpan_ring_open(process->pid);
+    if (process->ring == NULL)
+      return 0;
+  }
+  
+  cpu_time = process->ring->header->interval * 1000ULL;
+  while (etpan_ring_read(process->ring, &record)) {
+    check_symtable(process, record.frames, record.frame_count);
+    if (sampler->fold_recursion)
+      record.frame_count = fold_recursion(record.frames, record.frame_count);
+    add_stack_sample(process->thread_hash, record.tid,
+        record.frames, record.frame_count, cpu_time, 1);
+  }
+  
+  if (exited) {
+    /* left behind when the process was killed */
+    etpan_ring_unlink(process->ring);
+    return -1;
+  }
+  
+  return 0;
+}
+
+/* opens the events of the threads that appeared since the last tick */
+
+static void open_perf_events(struct sampler * sampler,
+    struct target_process * process)
+{
+  pid_t * tab;
+  unsigned int count;
+  unsigned int i;
+  int type;
+  int r;
+  
+  r = get_thread_list(process->pid, &tab, &count);
+  if (r < 0)
+    return;
+  if (sampler->thread_filter != NULL)
+    filter_thread_list(sampler->thread_filter, process->pid, tab, &count);
+  
+  for(i = 0 ; i < count ; i ++) {
+    chashdatum key;
+    chashdatum value;
+    
+    key.data = &tab[i];
+    key.len = sizeof(tab[i]);
+    if (chash_get(process->event_tid_hash, &key, &value) == 0)
+      continue;
+    value.data = NULL;
+    value.len = 0;
+    chash_set(process->event_tid_hash, &key, &value, NULL);
+    
+    for(type = 0 ; type < ETPAN_PERF_EVENT_COUNT ; type ++) {
+      struct etpan_perf_event * event;
+      
+      if (sampler->event_period[type] == 0)
+        continue;
+      
+      event = etpan_perf_event_open(tab[i], type,
+          sampler->event_period[type], sampler->event_kernel);
+      if ((event == NULL) && sampler->event_kernel &&
+          ((errno == EACCES) || (errno == EPERM))) {
+        fprintf(stderr, "kernel events are not allowed, context switches "
+            "and migrations will not be seen\n");
+        sampler->event_kernel = 0;
+        event = etpan_perf_event_open(tab[i], type,
+            sampler->event_period[type], sampler->event_kernel);
+      }
+      if (event == NULL) {
+        if (errno != ESRCH)
+          fprintf(stderr, "could not open the %s event of %i\n",
+              etpan_perf_event_name(type), tab[i]);
+        continue;
+      }
+      carray_add(process->event_list, event, NULL);
+    }
+  }
+  
+  free(tab);
+}
+
+/*
+  Adds the call chains sampled by the events since the last tick, each
+  of them for one period of its event. The events of the exited threads
+  are closed once read.
+  Returns -1 when the process is gone.
+*/
+
+static int read_perf_events(struct sampler * sampler,
+    struct target_process * process)
+{
+  unsigned int i;
+  int exited;
+  
+  /* the last samples are read after the exit */
+  exited = (kill(process->pid, 0) < 0);
+  if (!exited)
+    open_perf_events(sampler, process);
+  
+  i = 0;
+  while (i < carray_count(process->event_list)) {
+    struct etpan_perf_event * event;
+    struct etpan_perf_sample perf_sample;
+    chashdatum key;
+    
+    event = carray_get(process->event_list, i);
+    while (etpan_perf_event_read(event, &perf_sample)) {
+      check_symtable(process, perf_sample.frames, perf_sample.frame_count);
+      if (sampler->fold_recursion)
+        perf_sample.frame_count = fold_recursion(perf_sample.frames,
+            perf_sample.frame_count);
+      add_stack_sample(process->event_thread_hash[event->type],
+          perf_sample.tid, perf_sample.frames, perf_sample.frame_count,
+          0, sampler->event_period[event->type]);
+    }
+    
+    if (exited || (syscall(SYS_tgkill, process->pid, event->tid, 0) == 0)) {
+      i ++;
+      continue;
+    }
+    
+    key.data = &event->tid;
+    key.len = sizeof(event->tid);
+    chash_delete(process->event_tid_hash, &key, NULL);
+    process->event_lost += event->lost;
+    etpan_perf_event_close(event);
+    carray_delete(process->event_list, i);
+  }
+  
+  if (exited)
+    return -1;
+  
+  return 0;
+}
+
+static struct target_process * add_process(struct sampler * sampler,
+    pid_t pid)
+{
+  struct target_process * process;
+  chashdatum key;
+  chashdatum value;
+  char filename[PATH_MAX];
+  FILE * f;
+  int i;
+  
+  process = malloc(sizeof(* process));
+  process->pid = pid;
+  process->exited = 0;
+  process->merged_into = NULL;
+  process->comm[0] = '\0';
+  process->symtable_stale = 0;
+  process->symtable_refresh_tick = 0;
+  process->symtable_refresh_interval = SYMTABLE_REFRESH_TICKS;
+  process->ring = NULL;
+  process->event_list = NULL;
+  process->event_tid_hash = NULL;
+  process->event_lost = 0;
+  for(i = 0 ; i < ETPAN_PERF_EVENT_COUNT ; i ++)
+    process->event_thread_hash[i] = NULL;
+  
+  /* the symbols stay readable if the process exits while sampled */
+  process->symtable = etpan_get_symtable_with_cache(pid,
+      sampler->module_cache);
+  if (process->symtable == NULL) {
+    free(process);
+    return NULL;
+  }
+  if (sampler->kallsyms != NULL)
+    etpan_symbol_table_set_kallsyms(process->symtable, sampler->kallsyms);
+  
+  snprintf(filename, sizeof(filename), "/proc/%i/comm", pid);
+  f = fopen(filename, "r");
+  if (f != NULL) {
+    if (fgets(process->comm, sizeof(process->comm), f) != NULL)
+      process->comm[strcspn(process->comm, "\n")] = '\0';
+    fclose(f);
+  }
+  
+  process->thread_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  process->offcpu_thread_hash = NULL;
+  if (sampler->mode == SAMPLE_WALL_CLOCK)
+    process->offcpu_thread_hash = chash_new(CHASH_DEFAULTSIZE,
+        CHASH_COPYKEY);
+  if (sampler->event_count > 0) {
+    for(i = 0 ; i < ETPAN_PERF_EVENT_COUNT ; i ++) {
+      if (sampler->event_period[i] != 0)
+        process->event_thread_hash[i] = chash_new(CHASH_DEFAULTSIZE,
+            CHASH_COPYKEY);
+    }
+    process->event_list = carray_new(4);
+    process->event_tid_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+    open_perf_events(sampler, process);
+  }
+  
+  key.data = &pid;
+  key.len = sizeof(pid);
+  value.data = process;
+  value.len = 0;
+  chash_set(sampler->process_hash, &key, &value, NULL);
+  carray_add(sampler->process_list, process, NULL);
+  
+  return process;
+}
+
+/*
+  Reads the mappings again. When the unknown frames were not in a new
+  file, as for JIT code, the mappings are read less often.
+*/
+
+static void refresh_symtable(struct sampler * sampler,
+    struct target_process * process)
+{
+  struct etpan_symbol_table * current;
+  
+  process->symtable_stale = 0;
+  current = etpan_get_symtable_with_cache(process->pid,
+      sampler->module_cache);
+  if (current == NULL)
+    return;
+  
+  if (etpan_symbol_table_same_layout(current, process->symtable)) {
+    etpan_symbol_table_free(current);
+    if (process->symtable_refresh_interval < MAX_SYMTABLE_REFRESH_TICKS)
+      process->symtable_refresh_interval *= 2;
+  }
+  else {
+    etpan_symbol_table_free(process->symtable);
+    process->symtable = current;
+    if (sampler->kallsyms != NULL)
+      etpan_symbol_table_set_kallsyms(current, sampler->kallsyms);
+    process->symtable_refresh_interval = SYMTABLE_REFRESH_TICKS;
+  }
+  process->symtable_refresh_tick = sampler->tick +
+    process->symtable_refresh_interval;
+}
+
+static void thread_hash_free(chash * thread_hash)
+{
+  chashiter * iter;
+  
+  if (thread_hash == NULL)
+    return;
+  
+  for(iter = chash_begin(thread_hash) ; iter != NULL ;
+      iter = chash_next(thread_hash, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    stack_hash_free(value.data);
+  }
+  chash_free(thread_hash);
+}
+
+static void process_free(struct target_process * process)
+{
+  unsigned int i;
+  
+  thread_hash_free(process->thread_hash);
+  thread_hash_free(process->offcpu_thread_hash);
+  if (process->symtable != NULL)
+    etpan_symbol_table_free(process->symtable);
+  if (process->ring != NULL)
+    etpan_ring_close(process->ring);
+  if (process->event_list != NULL) {
+    for(i = 0 ; i < carray_count(process->event_list) ; i ++)
+      etpan_perf_event_close(carray_get(process->event_list, i));
+    carray_free(process->event_list);
+    chash_free(process->event_tid_hash);
+  }
+  for(i = 0 ; i < ETPAN_PERF_EVENT_COUNT ; i ++)
+    thread_hash_free(process->event_thread_hash[i]);
+  free(process);
+}
+
+/*
+  Processes whose parent is sampled are added, until no new one is
+  found, so that grandchildren are found in the same pass.
+*/
+
+static void add_child_processes(struct sampler * sampler)
+{
+  DIR * dir;
+  struct dirent * ent;
+  pid_t * pid_tab;
+  pid_t * ppid_tab;
+  unsigned int count;
+  unsigned int size;
+  unsigned int i;
+  int found;
+  
+  dir = opendir("/proc");
+  if (dir == NULL)
+    return;
+  
+  count = 0;
+  size = 64;
+  pid_tab = malloc(size * sizeof(* pid_tab));
+  ppid_tab = malloc(size * sizeof(* ppid_tab));
+  while ((ent = readdir(dir)) != NULL) {
+    char buf[1024];
+    char * p;
+    pid_t pid;
+    int ppid;
+    
+    if ((ent->d_name[0] < '0') || (ent->d_name[0] > '9'))
+      continue;
+    
+    pid = strtoul(ent->d_name, NULL, 10);
+    p = read_thread_stat(pid, pid, buf, sizeof(buf));
+    if (p == NULL)
+      continue;
+    if (sscanf(p, "%*c %i", &ppid) != 1)
+      continue;
+    
+    if (count >= size) {
+      size *= 2;
+      pid_tab = realloc(pid_tab, size * sizeof(* pid_tab));
+      ppid_tab = realloc(ppid_tab, size * sizeof(* ppid_tab));
+    }
+    pid_tab[count] = pid;
+    ppid_tab[count] = ppid;
+    count ++;
+  }
+  closedir(dir);
+  
+  do {
+    found = 0;
+    for(i = 0 ; i < count ; i ++) {
+      chashdatum key;
+      chashdatum value;
+      
+      key.data = &pid_tab[i];
+      key.len = sizeof(pid_tab[i]);
+      if (chash_get(sampler->process_hash, &key, &value) == 0)
+        continue;
+      key.data = &ppid_tab[i];
+      key.len = sizeof(ppid_tab[i]);
+      if (chash_get(sampler->process_hash, &key, &value) < 0)
+        continue;
+      
+      if (add_process(sampler, pid_tab[i]) != NULL)
+        found = 1;
+    }
+  } while (found);
+  
+  free(ppid_tab);
+  free(pid_tab);
+}
+
+/*
+  Runs a command, stopped at its first instruction after the exec so
+  that its mappings can be read. It is traced with PTRACE_SEIZE so
+  that it can be kept traced with -t.
+*/
+
+static pid_t launch_process(char ** command)
+{
+  pid_t pid;
+  int status;
+  
+  pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    /* waits for the sampler to trace the exec */
+    raise(SIGSTOP);
+    execvp(command[0], command);
+    _exit(127);
+  }
+  
+  if ((waitpid(pid, &status, WUNTRACED) < 0) || !WIFSTOPPED(status))
+    goto err;
+  if (ptrace(PTRACE_SEIZE, pid, 0, PTRACE_O_TRACEEXEC) < 0)
+    goto kill;
+  kill(pid, SIGCONT);
+  
+  while (1) {
+    if (waitpid(pid, &status, __WALL) < 0)
+      goto kill;
+    if (!WIFSTOPPED(status))
+      goto err;
+    if ((status >> 16) == PTRACE_EVENT_EXEC)
+      break;
+    /* the stop and the SIGCONT are not delivered again */
+    ptrace(PTRACE_CONT, pid, 0, 0);
+  }
+  
+  return pid;
+  
+ kill:
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, __WALL);
+ err:
+  return -1;
+}
+
+/* lets the launched command run once its mappings are read */
+
+static void start_launched_process(struct sampler * sampler, pid_t pid)
+{
+  sampler->launched_pid = pid;
+  if (sampler->trace_clone) {
+    ptrace(PTRACE_SETOPTIONS, pid, 0,
+        PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXIT);
+    track_thread(sampler, pid, pid);
+    ptrace(PTRACE_CONT, pid, 0, 0);
+  }
+  else {
+    detach(pid);
+  }
+}
+
+/* the launched command stays a zombie until it is waited for */
+
+static void reap_launched_process(struct sampler * sampler)
+{
+  int status;
+  
+  if (sampler->launched_pid == 0)
+    return;
+  
+  /* traced threads are waited for with their trace events */
+  if (sampler->trace_clone)
+    return;
+  
+  if (waitpid(sampler->launched_pid, &status, WNOHANG) ==
+      sampler->launched_pid)
+    sampler->launched_pid = 0;
+}
+
+/*
+  Samples all the processes once.
+  Returns -1 when all the processes are gone.
+*/
+
+static int sample_tick(struct sampler * sampler)
+{
+  unsigned long long tick_cpu_start;
+  unsigned long long cost;
+  struct sample_period * period;
+  unsigned int alive_count;
+  unsigned int i;
+  int r;
+  
+  tick_cpu_start = get_cpu_time_usec();
+  sampler->tick ++;
+  sampler->tick_over_budget = 0;
+  sampler->tick_stop_time = 0;
+  
+  if (sampler->trace_clone)
+    drain_trace_events(sampler);
+  reap_launched_process(sampler);
+  if (sampler->rescan_ticks == 0) {
+    if (sampler->follow_children)
+      add_child_processes(sampler);
+    if (sampler->trace_clone) {
+      for(i = 0 ; i < carray_count(sampler->process_list) ; i ++) {
+        struct target_process * process;
+        
+        process = carray_get(sampler->process_list, i);
+        if (!process->exited)
+          trace_new_threads(sampler, process->pid);
+      }
+    }
+    sampler->rescan_ticks = RESCAN_TICKS;
+  }
+  sampler->rescan_ticks --;
+  
+  alive_count = 0;
+  for(i = 0 ; i < carray_count(sampler->process_list) ; i ++) {
+    struct target_process * process;
+    
+    process = carray_get(sampler->process_list, i);
+    if (process->exited)
+      continue;
+    
+    if (sampler->preload)
+      r = read_ring(sampler, process);
+    else if (sampler->event_count > 0)
+      r = read_perf_events(sampler, process);
+    else
+      r = sample(sampler, process);
+    if (r < 0) {
+      fprintf(stderr, "process %i exited\n", process->pid);
+      process->exited = 1;
+      continue;
+    }
+    if (process->symtable_stale &&
+        (sampler->tick >= process->symtable_refresh_tick))
+      refresh_symtable(sampler, process);
+    alive_count ++;
+  }
+  
+  period = carray_get(sampler->period_list,
+      carray_count(sampler->period_list) - 1);
+  period->tick_count ++;
+  period->end = get_time_usec();
+  
+  cost = get_cpu_time_usec() - tick_cpu_start;
+  if (sampler->tick_stop_time > cost)
+    cost = sampler->tick_stop_time;
+  adjust_sample_delay(sampler, period, cost);
+  
+  if (sampler->tick_over_budget) {
+    sampler->aborted_tick_count ++;
+    sampler->budget_strikes ++;
+    if ((sampler->budget_strikes >= MAX_BUDGET_STRIKES) &&
+        (sampler->sample_delay < MAX_SAMPLE_DELAY)) {
+      sampler->min_sample_delay = sampler->sample_delay * 2;
+      set_sample_delay(sampler, sampler->min_sample_delay);
+      sampler->budget_strikes = 0;
+    }
+  }
+  else {
+    sampler->budget_strikes = 0;
+  }
+  
+  if (sampler->tick % RETIRE_TICKS == 0)
+    retire_exited_threads(sampler);
+  
+  if (alive_count == 0)
+    return -1;
+  
+  return 0;
+}
+
+static int compare_stack(const void * a, const void * b)
+{
+  struct stackframe_elt * const  * p_elt_a;
+  struct stackframe_elt * const * p_elt_b;
+  struct stackframe_elt * elt_a;
+  struct stackframe_elt * elt_b;
+  unsigned int min_stack;
+  unsigned int frame_index;
+  unsigned int offset_a;
+  unsigned int offset_b;
+  
+  p_elt_a = a;
+  p_elt_b = b;
+  elt_a = * p_elt_a;
+  elt_b = * p_elt_b;
+  min_stack = elt_a->stackframe_count;
+  if (elt_b->stackframe_count < min_stack)
+    min_stack = elt_b->stackframe_count;
+  offset_a = elt_a->stackframe_count - min_stack;
+  offset_b = elt_b->stackframe_count - min_stack;
+  
+  frame_index = min_stack - 1;
+  while (1) {
+    if (elt_a->stackframe[offset_a + frame_index] ==
+        elt_b->stackframe[offset_b + frame_index]) {
+      /* do nothing */
+    }
+    else if (elt_a->stackframe[offset_a + frame_index] <
+        elt_b->stackframe[offset_b + frame_index]) {
+      return -1;
+    }
+    else {
+      return 1;
+    }
+    if (frame_index == 0)
+      break;
+    
+    frame_index --;
+  }
+  
+  if (elt_a->stackframe_count < elt_b->stackframe_count)
+    return -1;
+  else if (elt_a->stackframe_count > elt_b->stackframe_count)
+    return 1;
+  
+  return 0;
+}
+
+static unsigned int common_count(struct stackframe_elt * elt_a,
+    struct stackframe_elt * elt_b)
+{
+  unsigned int min_stack;
+  unsigned int frame_index;
+  unsigned int offset_a;
+  unsigned int offset_b;
+  
+  min_stack = elt_a->stackframe_count;
+  if (elt_b->stackframe_count < min_stack)
+    min_stack = elt_b->stackframe_count;
+  offset_a = elt_a->stackframe_count - min_stack;
+  offset_b = elt_b->stackframe_count - min_stack;
+  
+  frame_index = min_stack - 1;
+  while (1) {
+    if (elt_a->stackframe[offset_a + frame_index] ==
+        elt_b->stackframe[offset_b + frame_index]) {
+      /* do nothing */
+    }
+    else {
+        return min_stack - 1 - frame_index;
+    }
+    if (frame_index == 0)
+      break;
+    
+    frame_index --;
+  }
+  
+  return min_stack;
+}
+
+static void print_stackframe(struct stackframe_elt * elt)
+{
+  unsigned int frame_index;
+  
+  printf("%u: ", elt->sample_count);
+  frame_index = elt->stackframe_count - 1;
+  while (1) {
+    printf("%p ", (void *) elt->stackframe[frame_index]);
+    if (frame_index == 0)
+      break;
+    
+    frame_index --;
+  }
+  printf("\n");
+}
+
+struct stackframe_node {
+  struct stackframe_elt * elt;
+  carray * children;
+};
+
+static int compare_sample(const void * a, const void * b)
+{
+  struct stackframe_node * const  * p_elt_a;
+  struct stackframe_node * const * p_elt_b;
+  struct stackframe_node * elt_a;
+  struct stackframe_node * elt_b;
+  
+  p_elt_a = a;
+  p_elt_b = b;
+  elt_a = * p_elt_a;
+  elt_b = * p_elt_b;
+  
+  return elt_b->elt->sample_count - elt_a->elt->sample_count;
+}
+
+static void sort_tree(struct stackframe_node * node)
+{
+  void ** data;
+  unsigned int i;
+  
+  data = carray_data(node->children);
+  qsort(data, carray_count(node->children), sizeof(* data), compare_sample);
+  for(i = 0 ; i < carray_count(node->children) ; i ++) {
+    struct stackframe_node * child;
+    
+    child = carray_get(node->children, i);
+    sort_tree(child);
+  }
+}
+
+static const char * my_basename(const char * basename)
+{
+  const char * result;
+  const char * p;
   
   result = basename;
   p = result;
   
-  while ((p = strchr(result, '/')) != NULL) {
-    result = p + 1;
-  }
+  while ((p = strchr(result, '/')) != NULL) {
+    result = p + 1;
+  }
+  
+  return result;
+}
+
+enum {
+  SHOW_CPU_TIME = 1 << 0,
+  /* estimated count with a 95% confidence interval */
+  SHOW_ESTIMATE = 1 << 1,
+};
+
+static void print_symbol(struct etpan_symbol_table * symtable,
+    unsigned long address)
+{
+  struct etpan_debug_symbol symbol;
+  int r;
+  
+  if (is_synthetic_frame(address)) {
+    print_synthetic_frame(address);
+    return;
+  }
+  
+  r = etpan_get_symbol(symtable, (void *) address, &symbol);
+  if (r) {
+    const char *name;
+    char address_str[32];
+    
+    name = symbol.functionname;
+    if (name == NULL || *name == '\0') {
+      snprintf(address_str, sizeof(address_str), "%p", (void *) address);
+      name = address_str;
+    }
+    
+    if (symbol.filename != NULL) {
+      printf("%s (in %s) %s:%u\n",
+          name, my_basename(symbol.libname),
+          my_basename(symbol.filename), symbol.line);
+    }
+    else {
+      printf("%s (in %s)\n",
+          name, my_basename(symbol.libname));
+    }
+  }
+  else {
+    printf("%p\n", (void *) address);
+  }
+}
+
+static void print_tree(struct etpan_symbol_table * symtable,
+    struct stackframe_node * node, unsigned int level, int show_flags)
+{
+  unsigned int i;
+  
+  if (level > 0) {
+    for(i = 0 ; i < level ; i ++)
+      printf(" ");
+    
+    printf("%u ", node->elt->sample_count);
+    if (show_flags & SHOW_ESTIMATE)
+      printf("[~%.0f +/- %.0f] ", node->elt->weight,
+          1.96 * sqrt(node->elt->weight_variance));
+    if (show_flags & SHOW_CPU_TIME)
+      printf("[%.1f ms] ", node->elt->cpu_time / 1000000.);
+    
+    print_symbol(symtable, node->elt->stackframe[0]);
+  }
+  
+  for(i = 0 ; i < carray_count(node->children) ; i ++) {
+    struct stackframe_node * child;
+    
+    child = carray_get(node->children, i);
+    print_tree(symtable, child, level + 1, show_flags);
+  }
+}
+
+static void show_tree(struct etpan_symbol_table * symtable,
+    struct stackframe_elt ** stack_table, unsigned int count,
+    int show_flags)
+{
+  unsigned int i;
+  struct stackframe_elt * elt;
+  unsigned int previous_count;
+  struct stackframe_elt * previous;
+  unsigned int indent;
+  carray * current_node;
+  struct stackframe_node * root;
+  
+  qsort(stack_table, count, sizeof(* stack_table), compare_stack);
+  
+  current_node = carray_new(16);
+  
+  root = malloc(sizeof(* root));
+  root->elt = NULL;
+  root->children = carray_new(4);
+  carray_add(current_node, root, NULL);
+  
+  indent = 0;
+  previous = NULL;
+  previous_count = 0;
+  for(i = 0 ; i < count ; i ++) {
+    unsigned int common;
+    struct stackframe_node * node;
+    struct stackframe_node * parent;
+    
+    elt = stack_table[i];
+    
+    common = 0;
+    if (previous_count > 0) {
+      unsigned int remove_count;
+      
+      common = common_count(previous, elt);
+      remove_count = (previous->stackframe_count - common);
+      indent -= remove_count;
+      carray_set_size(current_node, carray_count(current_node) - remove_count);
+    }
+    
+    parent = carray_get(current_node, carray_count(current_node) - 1);
+    node = malloc(sizeof(* root));
+    node->elt = elt;
+    node->children = carray_new(4);
+    carray_add(parent->children, node, NULL);
+    carray_add(current_node, node, NULL);
+    indent ++;
+    
+    previous = elt;
+    previous_count = elt->stackframe_count;
+  }
+  
+  sort_tree(root);
+  print_tree(symtable, root, 0, show_flags);
+}
+
+/*
+  Frames of stripped files are moved to the start of their function,
+  so that the samples of one function aggregate to a single node.
+  Returns a new hash of new elements.
+*/
+
+static chash * merge_function_frames(struct etpan_symbol_table * symtable,
+    chash * stack_hash)
+{
+  chash * merged_hash;
+  chashiter * iter;
+  
+  merged_hash = chash_new(chash_count(stack_hash), CHASH_COPYKEY);
+  for(iter = chash_begin(stack_hash) ; iter != NULL ;
+      iter = chash_next(stack_hash, iter)) {
+    chashdatum key;
+    chashdatum value;
+    struct stackframe_elt * elt;
+    struct stackframe_elt * merged_elt;
+    unsigned long * stackframe;
+    unsigned int i;
+    int r;
+    
+    chash_value(iter, &value);
+    elt = value.data;
+    
+    stackframe = malloc(elt->stackframe_count * sizeof(* stackframe));
+    for(i = 0 ; i < elt->stackframe_count ; i ++) {
+      void * start;
+      
+      if (etpan_get_function_start(symtable,
+              (void *) elt->stackframe[i], &start))
+        stackframe[i] = (unsigned long) start;
+      else
+        stackframe[i] = elt->stackframe[i];
+    }
+    
+    key.data = stackframe;
+    key.len = elt->stackframe_count * sizeof(* stackframe);
+    r = chash_get(merged_hash, &key, &value);
+    if (r < 0) {
+      merged_elt = malloc(sizeof(* merged_elt));
+      merged_elt->stackframe = stackframe;
+      merged_elt->stackframe_count = elt->stackframe_count;
+      merged_elt->sample_count = 0;
+      merged_elt->cpu_time = 0;
+      merged_elt->weight = 0;
+      merged_elt->weight_variance = 0;
+      stackframe_elt_add(merged_elt, elt);
+      value.data = merged_elt;
+      value.len = 0;
+      chash_set(merged_hash, &key, &value, NULL);
+    }
+    else {
+      merged_elt = value.data;
+      stackframe_elt_add(merged_elt, elt);
+      free(stackframe);
+    }
+  }
+  
+  return merged_hash;
+}
+
+struct hot_function {
+  unsigned long start;
+  unsigned long end;
+  int sample_count;
+};
+
+static int * pc_count_get(chash * pc_hash, unsigned long pc, int create)
+{
+  chashdatum key;
+  chashdatum value;
+  int * p_count;
+  int r;
+  
+  key.data = &pc;
+  key.len = sizeof(pc);
+  r = chash_get(pc_hash, &key, &value);
+  if (r == 0)
+    return value.data;
+  if (!create)
+    return NULL;
+  
+  p_count = malloc(sizeof(* p_count));
+  * p_count = 0;
+  value.data = p_count;
+  value.len = 0;
+  chash_set(pc_hash, &key, &value, NULL);
+  
+  return p_count;
+}
+
+/*
+  Samples where a PC is the leaf: the count of the element of which it is
+  the first frame, minus the counts of the elements one frame deeper.
+  The parent of an element is its stack without the first frame, so the
+  parent's first frame is stackframe[1].
+*/
+
+static void add_leaf_counts(chash * pc_hash, chash * stack_hash)
+{
+  chashiter * iter;
+  
+  for(iter = chash_begin(stack_hash) ; iter != NULL ;
+      iter = chash_next(stack_hash, iter)) {
+    chashdatum value;
+    struct stackframe_elt * elt;
+    
+    chash_value(iter, &value);
+    elt = value.data;
+    
+    * pc_count_get(pc_hash, elt->stackframe[0], 1) += elt->sample_count;
+    if (elt->stackframe_count >= 2)
+      * pc_count_get(pc_hash, elt->stackframe[1], 1) -= elt->sample_count;
+  }
+}
+
+static int compare_hot_function(const void * a, const void * b)
+{
+  struct hot_function * const * p_function_a;
+  struct hot_function * const * p_function_b;
+  
+  p_function_a = a;
+  p_function_b = b;
+  
+  return (* p_function_b)->sample_count - (* p_function_a)->sample_count;
+}
+
+static void print_instruction(void * address, const char * text,
+    void * cb_data)
+{
+  chash * pc_hash;
+  int * p_count;
+  
+  pc_hash = cb_data;
+  p_count = pc_count_get(pc_hash, (unsigned long) address, 0);
+  if ((p_count != NULL) && (* p_count > 0))
+    printf("  %6i %p: %s\n", * p_count, address, text);
+  else
+    printf("  %6s %p: %s\n", "", address, text);
+}
+
+/* number of leaf samples per PC, over all the threads */
+
+static chash * get_leaf_counts(chash * thread_hash)
+{
+  chash * pc_hash;
+  chashiter * iter;
+  
+  pc_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  for(iter = chash_begin(thread_hash) ; iter != NULL ;
+      iter = chash_next(thread_hash, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    add_leaf_counts(pc_hash, value.data);
+  }
+  
+  return pc_hash;
+}
+
+static void leaf_counts_free(chash * pc_hash)
+{
+  chashiter * iter;
+  
+  for(iter = chash_begin(pc_hash) ; iter != NULL ;
+      iter = chash_next(pc_hash, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    free(value.data);
+  }
+  chash_free(pc_hash);
+}
+
+static void show_hot_instructions(struct etpan_symbol_table * symtable,
+    chash * pc_hash, unsigned int max_function_count)
+{
+  chash * function_hash;
+  chashiter * iter;
+  struct hot_function ** function_table;
+  unsigned int count;
+  unsigned int i;
+  
+  function_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  for(iter = chash_begin(pc_hash) ; iter != NULL ;
+      iter = chash_next(pc_hash, iter)) {
+    chashdatum key;
+    chashdatum value;
+    unsigned long pc;
+    int * p_count;
+    void * start;
+    void * end;
+    struct hot_function * function;
+    int r;
+    
+    chash_key(iter, &key);
+    chash_value(iter, &value);
+    memcpy(&pc, key.data, sizeof(pc));
+    p_count = value.data;
+    if (* p_count <= 0)
+      continue;
+    
+    if (!etpan_get_function_range(symtable, (void *) pc, &start, &end))
+      continue;
+    
+    key.data = &start;
+    key.len = sizeof(start);
+    r = chash_get(function_hash, &key, &value);
+    if (r < 0) {
+      function = malloc(sizeof(* function));
+      function->start = (unsigned long) start;
+      function->end = (unsigned long) end;
+      function->sample_count = 0;
+      value.data = function;
+      value.len = 0;
+      chash_set(function_hash, &key, &value, NULL);
+    }
+    else {
+      function = value.data;
+    }
+    function->sample_count += * p_count;
+  }
+  
+  count = chash_count(function_hash);
+  function_table = malloc(count * sizeof(* function_table));
+  count = 0;
+  for(iter = chash_begin(function_hash) ; iter != NULL ;
+      iter = chash_next(function_hash, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    function_table[count] = value.data;
+    count ++;
+  }
+  qsort(function_table, count, sizeof(* function_table),
+      compare_hot_function);
+  
+  printf("hot instructions:\n");
+  for(i = 0 ; (i < count) && (i < max_function_count) ; i ++) {
+    struct hot_function * function;
+    struct etpan_debug_symbol symbol;
+    
+    function = function_table[i];
+    if (etpan_get_symbol(symtable, (void *) function->start, &symbol) &&
+        (symbol.functionname != NULL)) {
+      printf("%i %s (in %s)\n", function->sample_count,
+          symbol.functionname, my_basename(symbol.libname));
+    }
+    else {
+      printf("%i %p\n", function->sample_count, (void *) function->start);
+    }
+    etpan_disassemble_function(symtable, (void *) function->start,
+        print_instruction, pc_hash);
+  }
+  
+  for(i = 0 ; i < count ; i ++)
+    free(function_table[i]);
+  free(function_table);
+  chash_free(function_hash);
+}
+
+struct source_line {
+  unsigned int line;
+  int sample_count;
+};
+
+struct source_file {
+  const char * filename;
+  int sample_count;
+  /* line number -> struct source_line */
+  chash * line_hash;
+};
+
+static int compare_source_line(const void * a, const void * b)
+{
+  struct source_line * const * p_line_a;
+  struct source_line * const * p_line_b;
+  
+  p_line_a = a;
+  p_line_b = b;
+  
+  if ((* p_line_b)->sample_count != (* p_line_a)->sample_count)
+    return (* p_line_b)->sample_count - (* p_line_a)->sample_count;
+  
+  return (int) (* p_line_a)->line - (int) (* p_line_b)->line;
+}
+
+static int compare_source_file(const void * a, const void * b)
+{
+  struct source_file * const * p_file_a;
+  struct source_file * const * p_file_b;
+  
+  p_file_a = a;
+  p_file_b = b;
+  
+  return (* p_file_b)->sample_count - (* p_file_a)->sample_count;
+}
+
+static void add_source_line(chash * file_hash,
+    struct etpan_debug_symbol * symbol, int sample_count)
+{
+  chashdatum key;
+  chashdatum value;
+  struct source_file * file;
+  struct source_line * line;
+  int r;
+  
+  key.data = (void *) symbol->filename;
+  key.len = strlen(symbol->filename);
+  r = chash_get(file_hash, &key, &value);
+  if (r < 0) {
+    file = malloc(sizeof(* file));
+    file->filename = symbol->filename;
+    file->sample_count = 0;
+    file->line_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+    value.data = file;
+    value.len = 0;
+    chash_set(file_hash, &key, &value, NULL);
+  }
+  else {
+    file = value.data;
+  }
+  file->sample_count += sample_count;
+  
+  key.data = &symbol->line;
+  key.len = sizeof(symbol->line);
+  r = chash_get(file->line_hash, &key, &value);
+  if (r < 0) {
+    line = malloc(sizeof(* line));
+    line->line = symbol->line;
+    line->sample_count = 0;
+    value.data = line;
+    value.len = 0;
+    chash_set(file->line_hash, &key, &value, NULL);
+  }
+  else {
+    line = value.data;
+  }
+  line->sample_count += sample_count;
+}
+
+static void show_source_file(struct source_file * file)
+{
+  struct source_line ** line_table;
+  chashiter * iter;
+  unsigned int count;
+  unsigned int i;
+  
+  count = chash_count(file->line_hash);
+  line_table = malloc(count * sizeof(* line_table));
+  count = 0;
+  for(iter = chash_begin(file->line_hash) ; iter != NULL ;
+      iter = chash_next(file->line_hash, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    line_table[count] = value.data;
+    count ++;
+  }
+  qsort(line_table, count, sizeof(* line_table), compare_source_line);
+  
+  printf("%i %s\n", file->sample_count, file->filename);
+  for(i = 0 ; i < count ; i ++) {
+    printf("  %6i line %u\n", line_table[i]->sample_count,
+        line_table[i]->line);
+    free(line_table[i]);
+  }
+  free(line_table);
+}
+
+/* leaf samples bucketed by source line, each PC is symbolized once */
+
+static void show_source_lines(struct etpan_symbol_table * symtable,
+    chash * pc_hash)
+{
+  chash * file_hash;
+  chashiter * iter;
+  struct source_file ** file_table;
+  unsigned int count;
+  unsigned int i;
+  
+  file_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  for(iter = chash_begin(pc_hash) ; iter != NULL ;
+      iter = chash_next(pc_hash, iter)) {
+    chashdatum key;
+    chashdatum value;
+    struct etpan_debug_symbol symbol;
+    unsigned long pc;
+    int * p_count;
+    
+    chash_key(iter, &key);
+    chash_value(iter, &value);
+    memcpy(&pc, key.data, sizeof(pc));
+    p_count = value.data;
+    if (* p_count <= 0)
+      continue;
+    
+    if (!etpan_get_symbol(symtable, (void *) pc, &symbol))
+      continue;
+    if (symbol.filename == NULL)
+      continue;
+    
+    add_source_line(file_hash, &symbol, * p_count);
+  }
+  
+  count = chash_count(file_hash);
+  file_table = malloc(count * sizeof(* file_table));
+  count = 0;
+  for(iter = chash_begin(file_hash) ; iter != NULL ;
+      iter = chash_next(file_hash, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    file_table[count] = value.data;
+    count ++;
+  }
+  qsort(file_table, count, sizeof(* file_table), compare_source_file);
+  
+  printf("source lines:\n");
+  for(i = 0 ; i < count ; i ++) {
+    show_source_file(file_table[i]);
+    chash_free(file_table[i]->line_hash);
+    free(file_table[i]);
+  }
+  free(file_table);
+  chash_free(file_hash);
+}
+
+static void show_stack_hash(struct etpan_symbol_table * symtable,
+    chash * thread_stack_hash, int show_flags)
+{
+  chashiter * iter;
+  chash * stack_hash;
+  struct stackframe_elt ** stack_table;
+  unsigned int count;
+  
+  stack_hash = merge_function_frames(symtable, thread_stack_hash);
+  count = chash_count(stack_hash);
+  stack_table = malloc(count * sizeof(* stack_table));
+  count = 0;
+  for(iter = chash_begin(stack_hash) ; iter != NULL ;
+      iter = chash_next(stack_hash, iter)) {
+    chashdatum value;
+    struct stackframe_elt * elt;
+    
+    chash_value(iter, &value);
+    
+    elt = value.data;
+    stack_table[count] = elt;
+    
+    count ++;
+  }
+  show_tree(symtable, stack_table, count, show_flags);
+  free(stack_table);
+  stack_hash_free(stack_hash);
+}
+
+static void show_threads(struct etpan_symbol_table * symtable,
+    chash * thread_hash, int show_flags)
+{
+  chashiter * iter;
+  
+  for(iter = chash_begin(thread_hash) ; iter != NULL ;
+      iter = chash_next(thread_hash, iter)) {
+    chashdatum key;
+    chashdatum value;
+    pid_t pid;
+    
+    chash_key(iter, &key);
+    chash_value(iter, &value);
+    memcpy(&pid, key.data, sizeof(pid));
+    if (pid == EXITED_THREADS)
+      printf("exited threads:\n");
+    else if (pid == ALL_THREADS)
+      printf("all threads:\n");
+    else
+      printf("thread %u:\n", pid);
+    
+    show_stack_hash(symtable, value.data, show_flags);
+  }
+}
+
+/*
+  The trees of the threads can be merged by thread name, by the
+  function the threads started in, or all together. Symbols are then
+  resolved once per merged tree. The hashes of the threads are merged
+  by workers, a large group being split between them.
+*/
+
+#define MERGE_WORKERS 16
+/* the functions that start a thread are not deeper than that */
+#define MAX_START_DEPTH 8
+
+static const char * thread_start_function_tab[] = {
+  "_start",
+  "__libc_start_main",
+  "__libc_start_call_main",
+  "clone",
+  "clone3",
+  "__clone",
+  "__clone3",
+  "start_thread",
+  NULL,
+};
+
+struct thread_group_key {
+  int exited;
+  char name[16];
+  unsigned long root;
+};
+
+struct thread_group {
+  struct thread_group_key key;
+  /* the merged samples are stored under the tid of the first thread */
+  pid_t tid;
+  unsigned int thread_count;
+  chash ** member_tab;
+  unsigned int member_count;
+  /* merge tasks of the group */
+  unsigned int first_task;
+  unsigned int task_count;
+  chash * stack_hash;
+};
+
+struct merge_task {
+  chash ** member_tab;
+  unsigned int member_count;
+  chash * stack_hash;
+};
+
+struct merge_pool {
+  pthread_mutex_t lock;
+  struct merge_task * task_tab;
+  unsigned int task_count;
+  unsigned int next;
+};
+
+static int is_thread_start_frame(struct etpan_symbol_table * symtable,
+    unsigned long frame)
+{
+  struct etpan_debug_symbol symbol;
+  unsigned int i;
+  
+  if (is_synthetic_frame(frame))
+    return 1;
+  if (!etpan_get_symbol(symtable, (void *) frame, &symbol))
+    return 0;
+  if (symbol.functionname == NULL)
+    return 0;
+  
+  for(i = 0 ; thread_start_function_tab[i] != NULL ; i ++) {
+    if (strcmp(symbol.functionname, thread_start_function_tab[i]) == 0)
+      return 1;
+  }
+  
+  return 0;
+}
+
+/*
+  The start function of a thread is its first frame under the
+  functions that start threads, on the path with the most samples.
+  The stack hash has an element per path from the outermost frame.
+*/
+
+static unsigned long get_thread_root(struct etpan_symbol_table * symtable,
+    chash * stack_hash)
+{
+  chashiter * iter;
+  struct stackframe_elt * root_elt;
+  unsigned long root;
+  void * start;
+  
+  root_elt = NULL;
+  for(iter = chash_begin(stack_hash) ; iter != NULL ;
+      iter = chash_next(stack_hash, iter)) {
+    chashdatum value;
+    struct stackframe_elt * elt;
+    unsigned int i;
+    
+    chash_value(iter, &value);
+    elt = value.data;
+    if (elt->stackframe_count > MAX_START_DEPTH)
+      continue;
+    if ((root_elt != NULL) && (elt->sample_count <= root_elt->sample_count))
+      continue;
+    
+    /* innermost frame of the path first */
+    if (is_thread_start_frame(symtable, elt->stackframe[0]))
+      continue;
+    for(i = 1 ; i < elt->stackframe_count ; i ++) {
+      if (!is_thread_start_frame(symtable, elt->stackframe[i]))
+        break;
+    }
+    if (i < elt->stackframe_count)
+      continue;
+    
+    root_elt = elt;
+  }
+  if (root_elt == NULL)
+    return 0;
+  
+  root = root_elt->stackframe[0];
+  if (etpan_get_function_start(symtable, (void *) root, &start))
+    root = (unsigned long) start;
+  
+  return root;
+}
+
+static void get_thread_name(struct sampler * sampler, pid_t pid, pid_t tid,
+    char * name, size_t size)
+{
+  chashdatum key;
+  chashdatum value;
+  
+  key.data = &tid;
+  key.len = sizeof(tid);
+  if (chash_get(sampler->thread_state_hash, &key, &value) == 0) {
+    struct thread_state * state;
+    
+    state = value.data;
+    if (state->comm[0] != '\0') {
+      snprintf(name, size, "%s", state->comm);
+      return;
+    }
+  }
+  
+  /* the threads are not tracked with -p and -e */
+  if (read_thread_comm(pid, tid, name, size) < 0)
+    snprintf(name, size, "?");
+}
+
+static void * merge_worker(void * data)
+{
+  struct merge_pool * pool;
+  
+  pool = data;
+  while (1) {
+    struct merge_task * task;
+    unsigned int index;
+    unsigned int i;
+    
+    pthread_mutex_lock(&pool->lock);
+    index = pool->next;
+    if (index < pool->task_count)
+      pool->next ++;
+    pthread_mutex_unlock(&pool->lock);
+    if (index >= pool->task_count)
+      break;
+    
+    task = &pool->task_tab[index];
+    if (task->member_count == 1) {
+      task->stack_hash = task->member_tab[0];
+      continue;
+    }
+    task->stack_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+    for(i = 0 ; i < task->member_count ; i ++)
+      stack_hash_merge(task->stack_hash, task->member_tab[i]);
+  }
+  
+  return NULL;
+}
+
+static void merge_thread_groups(struct thread_group * group_tab,
+    unsigned int group_count, unsigned int thread_count)
+{
+  struct merge_pool pool;
+  pthread_t * worker_tab;
+  unsigned int worker_count;
+  unsigned int chunk_size;
+  unsigned int i;
+  long cpu_count;
+  
+  cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+  worker_count = MERGE_WORKERS;
+  if ((cpu_count > 0) && ((unsigned long) cpu_count < worker_count))
+    worker_count = cpu_count;
+  chunk_size = (thread_count + worker_count - 1) / worker_count;
+  if (chunk_size == 0)
+    chunk_size = 1;
+  
+  pool.task_tab = malloc((thread_count + group_count) *
+      sizeof(* pool.task_tab));
+  pool.task_count = 0;
+  pool.next = 0;
+  for(i = 0 ; i < group_count ; i ++) {
+    struct thread_group * group;
+    unsigned int j;
+    
+    group = &group_tab[i];
+    group->first_task = pool.task_count;
+    for(j = 0 ; j < group->member_count ; j += chunk_size) {
+      struct merge_task * task;
+      
+      task = &pool.task_tab[pool.task_count];
+      task->member_tab = group->member_tab + j;
+      task->member_count = group->member_count - j;
+      if (task->member_count > chunk_size)
+        task->member_count = chunk_size;
+      pool.task_count ++;
+    }
+    group->task_count = pool.task_count - group->first_task;
+  }
+  
+  if (worker_count > pool.task_count)
+    worker_count = pool.task_count;
+  pthread_mutex_init(&pool.lock, NULL);
+  worker_tab = malloc(worker_count * sizeof(* worker_tab));
+  for(i = 1 ; i < worker_count ; i ++)
+    pthread_create(&worker_tab[i], NULL, merge_worker, &pool);
+  merge_worker(&pool);
+  for(i = 1 ; i < worker_count ; i ++)
+    pthread_join(worker_tab[i], NULL);
+  free(worker_tab);
+  pthread_mutex_destroy(&pool.lock);
+  
+  for(i = 0 ; i < group_count ; i ++) {
+    struct thread_group * group;
+    unsigned int j;
+    
+    group = &group_tab[i];
+    group->stack_hash = pool.task_tab[group->first_task].stack_hash;
+    for(j = 1 ; j < group->task_count ; j ++)
+      stack_hash_merge(group->stack_hash,
+          pool.task_tab[group->first_task + j].stack_hash);
+  }
+  free(pool.task_tab);
+}
+
+static int compare_thread_group(const void * a, const void * b)
+{
+  const struct thread_group * group_a;
+  const struct thread_group * group_b;
+  
+  group_a = a;
+  group_b = b;
+  
+  return (int) group_b->thread_count - (int) group_a->thread_count;
+}
+
+/*
+  The hashes of the threads are replaced by one hash per group, under
+  the tid of the group.
+*/
+
+static struct thread_group * group_threads(struct sampler * sampler,
+    struct target_process * process, chash * thread_hash,
+    unsigned int * p_group_count)
+{
+  struct thread_group * group_tab;
+  unsigned int group_count;
+  unsigned int thread_count;
+  unsigned int * group_index_tab;
+  chash ** stack_hash_tab;
+  chash * key_hash;
+  chashiter * iter;
+  unsigned int i;
+  
+  thread_count = chash_count(thread_hash);
+  group_tab = malloc(thread_count * sizeof(* group_tab));
+  group_count = 0;
+  group_index_tab = malloc(thread_count * sizeof(* group_index_tab));
+  stack_hash_tab = malloc(thread_count * sizeof(* stack_hash_tab));
+  key_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  i = 0;
+  for(iter = chash_begin(thread_hash) ; iter != NULL ;
+      iter = chash_next(thread_hash, iter)) {
+    struct thread_group_key group_key;
+    chashdatum key;
+    chashdatum value;
+    pid_t tid;
+    
+    chash_key(iter, &key);
+    chash_value(iter, &value);
+    memcpy(&tid, key.data, sizeof(tid));
+    stack_hash_tab[i] = value.data;
+    
+    memset(&group_key, 0, sizeof(group_key));
+    switch (sampler->group_mode) {
+    case GROUP_THREADS_BY_NAME:
+      if (tid == EXITED_THREADS)
+        group_key.exited = 1;
+      else
+        get_thread_name(sampler, process->pid, tid,
+            group_key.name, sizeof(group_key.name));
+      break;
+    case GROUP_THREADS_BY_ROOT:
+      group_key.root = get_thread_root(process->symtable, value.data);
+      break;
+    }
+    
+    key.data = &group_key;
+    key.len = sizeof(group_key);
+    if (chash_get(key_hash, &key, &value) == 0) {
+      group_index_tab[i] = (unsigned int) (long) value.data;
+    }
+    else {
+      struct thread_group * group;
+      
+      group = &group_tab[group_count];
+      group->key = group_key;
+      group->tid = tid;
+      group->thread_count = 0;
+      group_index_tab[i] = group_count;
+      value.data = (void *) (long) group_count;
+      value.len = 0;
+      chash_set(key_hash, &key, &value, NULL);
+      group_count ++;
+    }
+    group_tab[group_index_tab[i]].thread_count ++;
+    i ++;
+  }
+  chash_free(key_hash);
+  
+  for(i = 0 ; i < group_count ; i ++) {
+    group_tab[i].member_tab = malloc(group_tab[i].thread_count *
+        sizeof(* group_tab[i].member_tab));
+    group_tab[i].member_count = 0;
+  }
+  for(i = 0 ; i < thread_count ; i ++) {
+    struct thread_group * group;
+    
+    group = &group_tab[group_index_tab[i]];
+    group->member_tab[group->member_count] = stack_hash_tab[i];
+    group->member_count ++;
+  }
+  free(stack_hash_tab);
+  free(group_index_tab);
+  
+  merge_thread_groups(group_tab, group_count, thread_count);
+  
+  chash_clear(thread_hash);
+  for(i = 0 ; i < group_count ; i ++) {
+    chashdatum key;
+    chashdatum value;
+    
+    free(group_tab[i].member_tab);
+    key.data = &group_tab[i].tid;
+    key.len = sizeof(group_tab[i].tid);
+    value.data = group_tab[i].stack_hash;
+    value.len = 0;
+    chash_set(thread_hash, &key, &value, NULL);
+  }
+  qsort(group_tab, group_count, sizeof(* group_tab), compare_thread_group);
+  
+  * p_group_count = group_count;
+  
+  return group_tab;
+}
+
+static void show_thread_groups(struct sampler * sampler,
+    struct target_process * process, chash * thread_hash, int show_flags)
+{
+  struct thread_group * group_tab;
+  unsigned int group_count;
+  unsigned int i;
+  
+  if (sampler->group_mode == GROUP_THREADS_NONE) {
+    show_threads(process->symtable, thread_hash, show_flags);
+    return;
+  }
+  
+  group_tab = group_threads(sampler, process, thread_hash, &group_count);
+  for(i = 0 ; i < group_count ; i ++) {
+    struct thread_group * group;
+    
+    group = &group_tab[i];
+    switch (sampler->group_mode) {
+    case GROUP_THREADS_BY_NAME:
+      if (group->key.exited)
+        printf("exited threads:\n");
+      else
+        printf("%u threads named %s:\n", group->thread_count,
+            group->key.name);
+      break;
+    case GROUP_THREADS_BY_ROOT:
+      if (group->key.root == 0) {
+        printf("%u threads:\n", group->thread_count);
+      }
+      else {
+        printf("%u threads started in ", group->thread_count);
+        print_symbol(process->symtable, group->key.root);
+      }
+      break;
+    default:
+      printf("all %u threads:\n", group->thread_count);
+      break;
+    }
+    
+    show_stack_hash(process->symtable, group->stack_hash, show_flags);
+  }
+  free(group_tab);
+}
+
+/* moves the samples of all the threads of thread_hash to stack_hash */
+
+static void merge_thread_samples(chash * stack_hash, chash * thread_hash)
+{
+  chashiter * iter;
+  
+  for(iter = chash_begin(thread_hash) ; iter != NULL ;
+      iter = chash_next(thread_hash, iter)) {
+    chashdatum value;
+    
+    chash_value(iter, &value);
+    stack_hash_merge(stack_hash, value.data);
+  }
+  chash_clear(thread_hash);
+}
+
+static void collapse_threads(chash * thread_hash)
+{
+  chash * stack_hash;
+  chashdatum key;
+  chashdatum value;
+  pid_t tid;
+  
+  if (thread_hash == NULL)
+    return;
+  
+  stack_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  merge_thread_samples(stack_hash, thread_hash);
+  
+  tid = ALL_THREADS;
+  key.data = &tid;
+  key.len = sizeof(tid);
+  value.data = stack_hash;
+  value.len = 0;
+  chash_set(thread_hash, &key, &value, NULL);
+}
+
+/*
+  Processes with the same mappings, such as the workers forked by a
+  master, can be symbolized with the same table. Their samples are
+  merged into the first process of the group, in a single tree.
+*/
+
+/* the leader threads were already collapsed in a single tree */
+
+static void merge_leader_samples(chash * leader_thread_hash,
+    chash * thread_hash)
+{
+  chashiter * iter;
+  chashdatum value;
   
-  return result;
+  if (leader_thread_hash == NULL)
+    return;
+  
+  iter = chash_begin(leader_thread_hash);
+  chash_value(iter, &value);
+  merge_thread_samples(value.data, thread_hash);
 }
 
-static void print_tree(struct etpan_symbol_table * symtable,
-    struct stackframe_node * node, unsigned int level)
+static void merge_processes(struct sampler * sampler)
 {
   unsigned int i;
-  int r;
+  unsigned int j;
+  unsigned int k;
   
-  if (level > 0) {
-    struct etpan_debug_symbol symbol;
+  for(i = 0 ; i < carray_count(sampler->process_list) ; i ++) {
+    struct target_process * process;
     
-    for(i = 0 ; i < level ; i ++)
-      printf(" ");
-    
-    r = etpan_get_symbol(symtable,
-        (void *) node->elt->stackframe[0], &symbol);
-    if (r) {
-      const char *name;
-      char address_str[32];
+    process = carray_get(sampler->process_list, i);
+    for(j = 0 ; j < i ; j ++) {
+      struct target_process * leader;
       
-      name = symbol.functionname;
-      if (name == NULL || *name == '\0') {
-        snprintf(address_str, sizeof(address_str), "%p",
-            (void *) node->elt->stackframe[0]);
-        name = address_str;
-      }
+      leader = carray_get(sampler->process_list, j);
+      if (leader->merged_into != NULL)
+        continue;
+      if (!etpan_symbol_table_same_layout(leader->symtable,
+              process->symtable))
+        continue;
       
-      if (symbol.filename != NULL) {
-        printf("%u %s (in %s) %s:%u\n", node->elt->sample_count,
-            name, my_basename(symbol.libname),
-            my_basename(symbol.filename), symbol.line);
-      }
-      else {
-        printf("%u %s (in %s)\n", node->elt->sample_count,
-            name, my_basename(symbol.libname));
-      }
+      process->merged_into = leader;
+      merge_leader_samples(leader->thread_hash, process->thread_hash);
+      merge_leader_samples(leader->offcpu_thread_hash,
+          process->offcpu_thread_hash);
+      for(k = 0 ; k < ETPAN_PERF_EVENT_COUNT ; k ++)
+        merge_leader_samples(leader->event_thread_hash[k],
+            process->event_thread_hash[k]);
+      break;
     }
-    else {
-      printf("%u %p\n", node->elt->sample_count,
-          (void *) node->elt->stackframe[0]);
+    
+    if (process->merged_into == NULL) {
+      collapse_threads(process->thread_hash);
+      collapse_threads(process->offcpu_thread_hash);
+      for(k = 0 ; k < ETPAN_PERF_EVENT_COUNT ; k ++)
+        collapse_threads(process->event_thread_hash[k]);
     }
   }
+}
+
+static void show_process_header(struct sampler * sampler,
+    struct target_process * process)
+{
+  unsigned int i;
   
-  for(i = 0 ; i < carray_count(node->children) ; i ++) {
-    struct stackframe_node * child;
+  printf("process %i", process->pid);
+  for(i = 0 ; i < carray_count(sampler->process_list) ; i ++) {
+    struct target_process * other;
     
-    child = carray_get(node->children, i);
-    print_tree(symtable, child, level + 1);
+    other = carray_get(sampler->process_list, i);
+    if (other->merged_into == process)
+      printf(" %i", other->pid);
   }
+  printf(" (%s):\n", process->comm);
 }
 
-static void show_tree(struct etpan_symbol_table * symtable,
-    struct stackframe_elt ** stack_table, unsigned int count)
+static void show_process(struct sampler * sampler,
+    struct target_process * process, int show_flags,
+    unsigned int hot_function_count, int show_lines)
+{
+  int i;
+  
+  /* the JIT may have written symbols while the process was sampled */
+  etpan_symbol_table_update_jit(process->symtable);
+  
+  if (sampler->event_count > 0) {
+    for(i = 0 ; i < ETPAN_PERF_EVENT_COUNT ; i ++) {
+      if (process->event_thread_hash[i] == NULL)
+        continue;
+      printf("%s:\n", etpan_perf_event_name(i));
+      show_thread_groups(sampler, process, process->event_thread_hash[i],
+          show_flags);
+    }
+    return;
+  }
+  
+  if (sampler->mode == SAMPLE_WALL_CLOCK)
+    printf("on-cpu:\n");
+  show_thread_groups(sampler, process, process->thread_hash, show_flags);
+  if (sampler->mode == SAMPLE_WALL_CLOCK) {
+    printf("off-cpu:\n");
+    show_thread_groups(sampler, process, process->offcpu_thread_hash,
+        show_flags);
+  }
+  
+  if ((hot_function_count > 0) || show_lines) {
+    chash * pc_hash;
+    
+    pc_hash = get_leaf_counts(process->thread_hash);
+    if (show_lines)
+      show_source_lines(process->symtable, pc_hash);
+    if (hot_function_count > 0)
+      show_hot_instructions(process->symtable, pc_hash,
+          hot_function_count);
+    leaf_counts_free(pc_hash);
+  }
+}
+
+/*
+  Quickstack: one snapshot of every thread of many processes. Workers
+  only stop and unwind the processes, symbols are resolved afterwards
+  by a single thread since bfd is not thread safe, with the files
+  shared between the processes loaded once.
+*/
+
+#define QUICKSTACK_WORKERS 16
+
+struct quickstack_thread {
+  pid_t tid;
+  unsigned long * stackframe;
+  unsigned int stackframe_count;
+};
+
+struct quickstack_process {
+  pid_t pid;
+  struct quickstack_thread * thread_tab;
+  unsigned int thread_count;
+};
+
+struct quickstack_pool {
+  pthread_mutex_t lock;
+  /* kernel stacks are captured too when set */
+  struct etpan_kallsyms * kallsyms;
+  struct quickstack_process * process_tab;
+  unsigned int process_count;
+  unsigned int next;
+};
+
+static void quickstack_capture(struct quickstack_pool * pool,
+    struct quickstack_process * process)
 {
+  pid_t * tab;
+  unsigned int count;
   unsigned int i;
-  struct stackframe_elt * elt;
-  unsigned int previous_count;
-  struct stackframe_elt * previous;
-  unsigned int indent;
-  carray * current_node;
-  struct stackframe_node * root;
+  int * attached;
+  struct kernel_stack * kernel_stack_tab;
+  int r;
   
-  qsort(stack_table, count, sizeof(* stack_table), compare_stack);
+  r = get_thread_list(process->pid, &tab, &count);
+  if (r < 0)
+    return;
   
-  current_node = carray_new(16);
+  /* before the threads are stopped */
+  kernel_stack_tab = malloc(count * sizeof(* kernel_stack_tab));
+  for(i = 0 ; i < count ; i ++) {
+    kernel_stack_tab[i].stackframe = NULL;
+    kernel_stack_tab[i].stackframe_count = 0;
+    if (pool->kallsyms != NULL)
+      get_kernel_stack(process->pid, tab[i], pool->kallsyms,
+          &kernel_stack_tab[i].stackframe,
+          &kernel_stack_tab[i].stackframe_count);
+  }
   
-  root = malloc(sizeof(* root));
-  root->elt = NULL;
-  root->children = carray_new(4);
-  carray_add(current_node, root, NULL);
+  attached = malloc(count * sizeof(* attached));
+  for(i = 0 ; i < count ; i ++) {
+    if (tab[i] == process->pid)
+      r = attach(tab[i]);
+    else
+      r = attach_thread(tab[i]);
+    attached[i] = (r == 0);
+  }
   
-  indent = 0;
-  previous = NULL;
-  previous_count = 0;
+  process->thread_tab = malloc(count * sizeof(* process->thread_tab));
   for(i = 0 ; i < count ; i ++) {
-    unsigned int common;
-    struct stackframe_node * node;
-    struct stackframe_node * parent;
+    struct quickstack_thread * thread;
+    struct unwind_cache cache;
     
-    elt = stack_table[i];
+    if (!attached[i])
+      continue;
     
-    common = 0;
-    if (previous_count > 0) {
-      unsigned int remove_count;
+    thread = &process->thread_tab[process->thread_count];
+    unwind_cache_init(&cache);
+    r = get_stack(tab[i], &cache, MAX_STACK_DEPTH, &thread->stackframe,
+        &thread->stackframe_count);
+    unwind_cache_done(&cache);
+    if (r < 0)
+      continue;
+    if (kernel_stack_tab[i].stackframe_count > 0) {
+      unsigned long * full_stackframe;
+      unsigned int kernel_count;
       
-      common = common_count(previous, elt);
-      remove_count = (previous->stackframe_count - common);
-      indent -= remove_count;
-      carray_set_size(current_node, carray_count(current_node) - remove_count);
+      kernel_count = kernel_stack_tab[i].stackframe_count;
+      full_stackframe = malloc((kernel_count + thread->stackframe_count) *
+          sizeof(* full_stackframe));
+      memcpy(full_stackframe, kernel_stack_tab[i].stackframe,
+          kernel_count * sizeof(* full_stackframe));
+      memcpy(full_stackframe + kernel_count, thread->stackframe,
+          thread->stackframe_count * sizeof(* full_stackframe));
+      free(thread->stackframe);
+      thread->stackframe = full_stackframe;
+      thread->stackframe_count += kernel_count;
     }
+    thread->tid = tab[i];
+    process->thread_count ++;
+  }
+  
+  for(i = 0 ; i < count ; i ++) {
+    if (attached[i] && (tab[i] != process->pid))
+      detach(tab[i]);
+  }
+  for(i = 0 ; i < count ; i ++) {
+    if (attached[i] && (tab[i] == process->pid))
+      detach(tab[i]);
+  }
+  
+  for(i = 0 ; i < count ; i ++)
+    free(kernel_stack_tab[i].stackframe);
+  free(kernel_stack_tab);
+  free(attached);
+  free(tab);
+}
+
+static void * quickstack_worker(void * data)
+{
+  struct quickstack_pool * pool;
+  
+  pool = data;
+  while (1) {
+    unsigned int index;
     
-    parent = carray_get(current_node, carray_count(current_node) - 1);
-    node = malloc(sizeof(* root));
-    node->elt = elt;
-    node->children = carray_new(4);
-    carray_add(parent->children, node, NULL);
-    carray_add(current_node, node, NULL);
-    indent ++;
+    pthread_mutex_lock(&pool->lock);
+    index = pool->next;
+    if (index < pool->process_count)
+      pool->next ++;
+    pthread_mutex_unlock(&pool->lock);
+    if (index >= pool->process_count)
+      break;
     
-    previous = elt;
-    previous_count = elt->stackframe_count;
+    quickstack_capture(pool, &pool->process_tab[index]);
   }
   
-  sort_tree(root);
-  print_tree(symtable, root, 0);
+  return NULL;
+}
+
+/* pids of the processes whose name matches the pattern */
+
+static void find_processes_by_name(const char * pattern, carray * pid_list)
+{
+  DIR * dir;
+  struct dirent * ent;
+  
+  dir = opendir("/proc");
+  if (dir == NULL)
+    return;
+  
+  while ((ent = readdir(dir)) != NULL) {
+    char comm[32];
+    pid_t pid;
+    
+    if ((ent->d_name[0] < '0') || (ent->d_name[0] > '9'))
+      continue;
+    pid = strtoul(ent->d_name, NULL, 10);
+    if (pid == getpid())
+      continue;
+    if (read_process_comm(pid, comm, sizeof(comm)) < 0)
+      continue;
+    if (fnmatch(pattern, comm, 0) != 0)
+      continue;
+    
+    carray_add(pid_list, (void *) (long) pid, NULL);
+  }
+  closedir(dir);
+}
+
+static void quickstack(carray * pid_list, unsigned int worker_count,
+    struct etpan_kallsyms * kallsyms)
+{
+  struct quickstack_pool pool;
+  struct etpan_module_cache * module_cache;
+  pthread_t * worker_tab;
+  unsigned int i;
+  
+  pthread_mutex_init(&pool.lock, NULL);
+  pool.kallsyms = kallsyms;
+  pool.process_count = carray_count(pid_list);
+  pool.process_tab = malloc(pool.process_count * sizeof(* pool.process_tab));
+  pool.next = 0;
+  for(i = 0 ; i < pool.process_count ; i ++) {
+    pool.process_tab[i].pid = (pid_t) (long) carray_get(pid_list, i);
+    pool.process_tab[i].thread_tab = NULL;
+    pool.process_tab[i].thread_count = 0;
+  }
+  
+  if (worker_count > pool.process_count)
+    worker_count = pool.process_count;
+  worker_tab = malloc(worker_count * sizeof(* worker_tab));
+  for(i = 0 ; i < worker_count ; i ++)
+    pthread_create(&worker_tab[i], NULL, quickstack_worker, &pool);
+  for(i = 0 ; i < worker_count ; i ++)
+    pthread_join(worker_tab[i], NULL);
+  free(worker_tab);
+  pthread_mutex_destroy(&pool.lock);
+  
+  module_cache = etpan_module_cache_new();
+  for(i = 0 ; i < pool.process_count ; i ++) {
+    struct quickstack_process * process;
+    struct etpan_symbol_table * symtable;
+    char comm[32];
+    unsigned int j;
+    
+    process = &pool.process_tab[i];
+    if (read_process_comm(process->pid, comm, sizeof(comm)) < 0)
+      strcpy(comm, "?");
+    printf("process %i (%s):\n", process->pid, comm);
+    
+    symtable = etpan_get_symtable_with_cache(process->pid, module_cache);
+    if ((symtable != NULL) && (kallsyms != NULL))
+      etpan_symbol_table_set_kallsyms(symtable, kallsyms);
+    
+    for(j = 0 ; j < process->thread_count ; j ++) {
+      struct quickstack_thread * thread;
+      unsigned int k;
+      
+      thread = &process->thread_tab[j];
+      printf(" thread %i:\n", thread->tid);
+      for(k = 0 ; k < thread->stackframe_count ; k ++) {
+        printf("  #%u ", k);
+        if (symtable != NULL)
+          print_symbol(symtable, thread->stackframe[k]);
+        else
+          printf("%p\n", (void *) thread->stackframe[k]);
+      }
+      free(thread->stackframe);
+    }
+    
+    if (symtable != NULL)
+      etpan_symbol_table_free(symtable);
+    free(process->thread_tab);
+  }
+  etpan_module_cache_free(module_cache);
+  free(pool.process_tab);
 }
 
 int main(int argc, char ** argv)
 {
-  pid_t pid;
   unsigned int k;
-  chash * thread_hash;
+  unsigned int duration;
   unsigned int sample_count;
-  unsigned int sample_delay;
+  unsigned long long sample_end;
   chashiter * iter;
-  struct etpan_symbol_table * symtable;
+  struct sampler sampler;
+  unsigned int hot_function_count;
+  int show_lines;
+  int show_flags;
+  int merge_output;
+  int quickstack_mode;
+  unsigned int worker_count;
+  carray * pid_list;
+  char ** command;
+  int opt;
+  int r;
+  
+  sampler.mode = SAMPLE_ALL_THREADS;
+  sampler.preload = 0;
+  for(k = 0 ; k < ETPAN_PERF_EVENT_COUNT ; k ++)
+    sampler.event_period[k] = 0;
+  sampler.event_count = 0;
+  sampler.event_kernel = 1;
+  sampler.kernel_stack = 0;
+  sampler.kallsyms = NULL;
+  sampler.max_stack_depth = MAX_STACK_DEPTH;
+  sampler.fold_recursion = 0;
+  sampler.reuse_idle_stack = 0;
+  sampler.cpu_time_weight = 0;
+  sampler.max_process_threads = 0;
+  sampler.sample_delay = 0;
+  sampler.min_sample_delay = MIN_SAMPLE_DELAY;
+  sampler.period_list = carray_new(4);
+  sampler.max_overhead = 0;
+  sampler.tick_cost = 0;
+  sampler.pause_budget = 0;
+  sampler.budget_strikes = 0;
+  sampler.aborted_tick_count = 0;
+  sampler.trace_clone = 0;
+  sampler.traced_hash = NULL;
+  sampler.rescan_ticks = 0;
+  sampler.follow_children = 0;
+  sampler.launched_pid = 0;
+  sampler.thread_filter = NULL;
+  sampler.group_mode = GROUP_THREADS_NONE;
+  sampler.tick = 0;
+  sampler.vanished_count = 0;
+  sampler.retired_count = 0;
+  memset(&sampler.pause_histogram, 0, sizeof(sampler.pause_histogram));
+  hot_function_count = 0;
+  show_lines = 0;
+  merge_output = 0;
+  quickstack_mode = 0;
+  worker_count = QUICKSTACK_WORKERS;
+  pid_list = carray_new(16);
   
-  if (argc < 3) {
-    fprintf(stderr, "syntax: sample <pid> <delay>\n");
-    exit(EXIT_FAILURE);
+  /* the command to launch follows -- */
+  command = NULL;
+  for(k = 1 ; k < (unsigned int) argc ; k ++) {
+    if (strcmp(argv[k], "--") == 0) {
+      command = argv + k + 1;
+      argc = k;
+      break;
+    }
   }
+  if ((command != NULL) && (command[0] == NULL))
+    goto usage;
   
-  pid = strtoul(argv[1], NULL, 10);
+  while ((opt = getopt(argc, argv, "ka:lirwcs:b:o:tfmqj:n:pe:N:R:T:K:D:Fg:")) != -1) {
+    switch (opt) {
+    case 'k':
+      sampler.kernel_stack = 1;
+      break;
+    case 'i':
+      sampler.reuse_idle_stack = 1;
+      break;
+    case 'r':
+      sampler.mode = SAMPLE_RUNNING_THREADS;
+      break;
+    case 'w':
+      sampler.mode = SAMPLE_WALL_CLOCK;
+      break;
+    case 'c':
+      sampler.cpu_time_weight = 1;
+      break;
+    case 's':
+      sampler.max_process_threads = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      sampler.pause_budget = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      sampler.trace_clone = 1;
+      break;
+    case 'f':
+      sampler.follow_children = 1;
+      break;
+    case 'm':
+      merge_output = 1;
+      break;
+    case 'q':
+      quickstack_mode = 1;
+      break;
+    case 'p':
+      sampler.preload = 1;
+      break;
+    case 'e':
+      {
+        char * period;
+        int type;
+        
+        /* name[:period] */
+        period = strchr(optarg, ':');
+        if (period != NULL) {
+          * period = '\0';
+          period ++;
+        }
+        type = etpan_perf_event_lookup(optarg);
+        if (type < 0)
+          goto usage;
+        if (sampler.event_period[type] == 0)
+          sampler.event_count ++;
+        sampler.event_period[type] = etpan_perf_event_default_period(type);
+        if (period != NULL)
+          sampler.event_period[type] = strtoul(period, NULL, 10);
+        if (sampler.event_period[type] == 0)
+          goto usage;
+      }
+      break;
+    case 'j':
+      worker_count = strtoul(optarg, NULL, 10);
+      if (worker_count == 0)
+        goto usage;
+      break;
+    case 'n':
+      find_processes_by_name(optarg, pid_list);
+      break;
+    case 'g':
+      if (strcmp(optarg, "name") == 0)
+        sampler.group_mode = GROUP_THREADS_BY_NAME;
+      else if (strcmp(optarg, "root") == 0)
+        sampler.group_mode = GROUP_THREADS_BY_ROOT;
+      else if (strcmp(optarg, "all") == 0)
+        sampler.group_mode = GROUP_THREADS_ALL;
+      else
+        goto usage;
+      break;
+    case 'D':
+      sampler.max_stack_depth = strtoul(optarg, NULL, 10);
+      if (sampler.max_stack_depth == 0)
+        goto usage;
+      break;
+    case 'F':
+      sampler.fold_recursion = 1;
+      break;
+    case 'N':
+      if (sampler.thread_filter == NULL)
+        sampler.thread_filter = thread_filter_new();
+      sampler.thread_filter->name_pattern = optarg;
+      break;
+    case 'R':
+      if (sampler.thread_filter == NULL)
+        sampler.thread_filter = thread_filter_new();
+      if (sampler.thread_filter->has_name_regex)
+        regfree(&sampler.thread_filter->name_regex);
+      sampler.thread_filter->has_name_regex = 0;
+      if (regcomp(&sampler.thread_filter->name_regex, optarg,
+              REG_EXTENDED | REG_NOSUB) != 0)
+        goto usage;
+      sampler.thread_filter->has_name_regex = 1;
+      break;
+    case 'T':
+      if (sampler.thread_filter == NULL)
+        sampler.thread_filter = thread_filter_new();
+      if (thread_filter_add_tids(sampler.thread_filter, optarg) < 0)
+        goto usage;
+      break;
+    case 'K':
+      if (sampler.thread_filter == NULL)
+        sampler.thread_filter = thread_filter_new();
+      sampler.thread_filter->top_count = strtoul(optarg, NULL, 10);
+      if (sampler.thread_filter->top_count == 0)
+        goto usage;
+      break;
+    case 'o':
+      sampler.max_overhead = strtoul(optarg, NULL, 10);
+      if ((sampler.max_overhead == 0) || (sampler.max_overhead > 100))
+        goto usage;
+      break;
+    case 'a':
+      hot_function_count = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      show_lines = 1;
+      break;
+    default:
+      goto usage;
+    }
+  }
   
-  thread_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  /* the call chains of the events have kernel frames */
+  if (sampler.event_count > 0) {
+    if (sampler.preload || sampler.kernel_stack ||
+        (sampler.mode == SAMPLE_WALL_CLOCK) || sampler.reuse_idle_stack ||
+        (sampler.max_process_threads > 0) || (sampler.pause_budget > 0) ||
+        sampler.trace_clone || quickstack_mode ||
+        (sampler.max_stack_depth != MAX_STACK_DEPTH) ||
+        (hot_function_count > 0) || show_lines)
+      goto usage;
+    /* the events of a thread stay open once it is selected */
+    if ((sampler.thread_filter != NULL) &&
+        (sampler.thread_filter->top_count > 0))
+      goto usage;
+    sampler.kallsyms = etpan_kallsyms_read();
+  }
   
-  sample_delay = 10 * 1000;
-  sample_count = strtoul(argv[2], NULL, 10) * (1000000 / sample_delay);
-  printf("sampling %u %u\n", sample_delay, sample_count);
-  for(k = 0 ; k < sample_count ; k ++) {
-    sample(pid, thread_hash);
-    usleep(sample_delay);
+  if (sampler.kernel_stack) {
+    sampler.kallsyms = etpan_kallsyms_read();
+    if (sampler.kallsyms == NULL) {
+      fprintf(stderr, "kernel symbols are not readable, "
+          "kernel stacks disabled\n");
+      sampler.kernel_stack = 0;
+    }
   }
   
-  symtable = etpan_get_symtable(pid);
+  /* the collector only sees the threads running on a CPU */
+  if (sampler.preload &&
+      ((sampler.mode == SAMPLE_WALL_CLOCK) || sampler.kernel_stack ||
+          sampler.reuse_idle_stack || (sampler.max_process_threads > 0) ||
+          (sampler.pause_budget > 0) || sampler.trace_clone ||
+          (sampler.thread_filter != NULL) ||
+          (sampler.max_stack_depth != MAX_STACK_DEPTH) || quickstack_mode))
+    goto usage;
   
-  for(iter = chash_begin(thread_hash) ; iter != NULL ;
-      iter = chash_next(thread_hash, iter)) {
-    chashdatum key;
-    chashdatum value;
-    chashiter * stack_iter;
-    chash * stack_hash;
-    pid_t pid;
-    struct stackframe_elt ** stack_table;
-    unsigned int count;
+  /* the processes are merged with all their threads */
+  if (merge_output && (sampler.group_mode != GROUP_THREADS_NONE))
+    goto usage;
+  
+  if (quickstack_mode &&
+      ((sampler.thread_filter != NULL) ||
+          (sampler.group_mode != GROUP_THREADS_NONE) ||
+          (sampler.max_stack_depth != MAX_STACK_DEPTH) ||
+          sampler.fold_recursion))
+    goto usage;
+  
+  if (quickstack_mode) {
+    if (command != NULL)
+      goto usage;
+    for(k = optind ; k < (unsigned int) argc ; k ++) {
+      pid_t pid;
+      
+      pid = strtoul(argv[k], NULL, 10);
+      carray_add(pid_list, (void *) (long) pid, NULL);
+    }
+    if (carray_count(pid_list) == 0)
+      goto usage;
     
-    chash_key(iter, &key);
-    chash_value(iter, &value);
-    memcpy(&pid, key.data, sizeof(pid));
-    printf("thread %u:\n", pid);
+    quickstack(pid_list, worker_count, sampler.kallsyms);
+    exit(EXIT_SUCCESS);
+  }
+  
+  if (command != NULL) {
+    /* without a delay, sampled until the command exits */
+    if (argc - optind > 1)
+      goto usage;
+    duration = 0;
+    if (argc - optind == 1)
+      duration = strtoul(argv[argc - 1], NULL, 10);
+  }
+  else {
+    if (argc - optind < 1)
+      goto usage;
     
-    stack_hash = value.data;
-    count = chash_count(stack_hash);
-    stack_table = malloc(count * sizeof(* stack_table));
-    count = 0;
-    for(stack_iter = chash_begin(stack_hash) ; stack_iter != NULL ;
-        stack_iter = chash_next(stack_hash, stack_iter)) {
-      struct stackframe_elt * elt;
+    duration = strtoul(argv[argc - 1], NULL, 10);
+    for(k = optind ; k < (unsigned int) argc - 1 ; k ++) {
+      pid_t pid;
       
-      chash_value(stack_iter, &value);
+      pid = strtoul(argv[k], NULL, 10);
+      carray_add(pid_list, (void *) (long) pid, NULL);
+    }
+    if (carray_count(pid_list) == 0)
+      goto usage;
+  }
+  sampler.thread_state_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  
+  if (sampler.max_process_threads > 0)
+    srandom(time(NULL) ^ getpid());
+  if (sampler.trace_clone)
+    sampler.traced_hash = chash_new(CHASH_DEFAULTSIZE,
+        CHASH_COPYKEY | CHASH_COPYVALUE);
+  
+  sampler.module_cache = etpan_module_cache_new();
+  sampler.batch_read = etpan_batch_read_new();
+  raise_fd_limit();
+  sampler.process_list = carray_new(4);
+  sampler.process_hash = chash_new(CHASH_DEFAULTSIZE, CHASH_COPYKEY);
+  if (command != NULL) {
+    pid_t pid;
+    
+    pid = launch_process(command);
+    if (pid < 0) {
+      fprintf(stderr, "could not launch %s\n", command[0]);
+      exit(EXIT_FAILURE);
+    }
+    if (add_process(&sampler, pid) == NULL) {
+      fprintf(stderr, "could not read the mappings of %i\n", pid);
+      kill(pid, SIGKILL);
+      exit(EXIT_FAILURE);
+    }
+    start_launched_process(&sampler, pid);
+  }
+  for(k = 0 ; k < carray_count(pid_list) ; k ++) {
+    pid_t pid;
+    
+    pid = (pid_t) (long) carray_get(pid_list, k);
+    if (add_process(&sampler, pid) == NULL) {
+      fprintf(stderr, "could not read the mappings of %i\n", pid);
+      exit(EXIT_FAILURE);
+    }
+  }
+  
+  set_sample_delay(&sampler, 10 * 1000);
+  sample_count = duration * (1000000 / sampler.sample_delay);
+  printf("sampling %u %u\n", sampler.sample_delay, sample_count);
+  /* the delay can be raised while sampling */
+  sample_end = get_time_usec() + duration * 1000000ULL;
+  k = 0;
+  while ((duration == 0) || (get_time_usec() < sample_end)) {
+    r = sample_tick(&sampler);
+    if (r < 0)
+      break;
+    usleep(sampler.sample_delay);
+    k ++;
+  }
+  if (sampler.trace_clone) {
+    untrace_threads(&sampler);
+    chash_free(sampler.traced_hash);
+  }
+  if (sampler.vanished_count > 0) {
+    printf("%u threads exited while being sampled\n",
+        sampler.vanished_count);
+  }
+  if (sampler.retired_count > 0)
+    printf("%u exited threads retired\n", sampler.retired_count);
+  if (sampler.preload) {
+    unsigned long lost;
+    
+    lost = 0;
+    for(k = 0 ; k < carray_count(sampler.process_list) ; k ++) {
+      struct target_process * process;
       
-      elt = value.data;
-      stack_table[count] = elt;
+      process = carray_get(sampler.process_list, k);
+      if (process->ring != NULL)
+        lost += process->ring->lost;
+    }
+    if (lost > 0)
+      printf("%lu stacks were overwritten before being read\n", lost);
+  }
+  if (sampler.event_count > 0) {
+    unsigned long long lost;
+    
+    lost = 0;
+    for(k = 0 ; k < carray_count(sampler.process_list) ; k ++) {
+      struct target_process * process;
+      unsigned int i;
       
-      count ++;
+      process = carray_get(sampler.process_list, k);
+      lost += process->event_lost;
+      for(i = 0 ; i < carray_count(process->event_list) ; i ++) {
+        struct etpan_perf_event * event;
+        
+        event = carray_get(process->event_list, i);
+        lost += event->lost;
+      }
     }
-    show_tree(symtable, stack_table, count);
-    free(stack_table);
+    if (lost > 0)
+      printf("%llu event samples were lost\n", lost);
+  }
+  if (sampler.aborted_tick_count > 0) {
+    printf("%u of %u ticks went over the pause budget, delay %u us\n",
+        sampler.aborted_tick_count, k, sampler.sample_delay);
+  }
+  
+  /* libraries loaded since the last refresh */
+  for(k = 0 ; k < carray_count(sampler.process_list) ; k ++) {
+    struct target_process * process;
+    
+    process = carray_get(sampler.process_list, k);
+    if (process->exited || !process->symtable_stale)
+      continue;
+    
+    refresh_symtable(&sampler, process);
   }
   
-  etpan_symbol_table_free(symtable);
+  show_flags = 0;
+  if (sampler.cpu_time_weight)
+    show_flags |= SHOW_CPU_TIME;
+  if (sampler.max_process_threads > 0)
+    show_flags |= SHOW_ESTIMATE;
+  for(k = 0 ; k < ETPAN_PERF_EVENT_COUNT ; k ++) {
+    if (sampler.event_period[k] > 1)
+      show_flags |= SHOW_ESTIMATE;
+  }
+  
+  if (merge_output)
+    merge_processes(&sampler);
+  for(k = 0 ; k < carray_count(sampler.process_list) ; k ++) {
+    struct target_process * process;
+    
+    process = carray_get(sampler.process_list, k);
+    if (process->merged_into != NULL)
+      continue;
+    
+    if (carray_count(sampler.process_list) > 1)
+      show_process_header(&sampler, process);
+    show_process(&sampler, process, show_flags,
+        hot_function_count, show_lines);
+  }
+  
+  show_sample_periods(&sampler);
+  show_pause_histogram(&sampler.pause_histogram);
+  
+  for(k = 0 ; k < carray_count(sampler.process_list) ; k ++)
+    process_free(carray_get(sampler.process_list, k));
+  carray_free(sampler.process_list);
+  chash_free(sampler.process_hash);
+  etpan_module_cache_free(sampler.module_cache);
+  etpan_batch_read_free(sampler.batch_read);
+  if (sampler.thread_filter != NULL)
+    thread_filter_free(sampler.thread_filter);
+  if (sampler.kallsyms != NULL)
+    etpan_kallsyms_free(sampler.kallsyms);
+  for(iter = chash_begin(sampler.thread_state_hash) ; iter != NULL ;
+      iter = chash_next(sampler.thread_state_hash, iter)) {
+    chashdatum value;
+    struct thread_state * state;
+    
+    chash_value(iter, &value);
+    state = value.data;
+    thread_state_free(state);
+  }
+  chash_free(sampler.thread_state_hash);
+  for(k = 0 ; k < carray_count(sampler.period_list) ; k ++)
+    free(carray_get(sampler.period_list, k));
+  carray_free(sampler.period_list);
+  carray_free(pid_list);
   
-  chash_free(thread_hash);
-
   exit(EXIT_SUCCESS);
+  
+ usage:
+  fprintf(stderr, "syntax: sample [-r | -w] [-k] [-i] [-c] [-s count] [-b usec] "
+      "[-o percent] [-t] [-f] [-m] [-p] [-e event[:period]] [-l] "
+      "[-D depth] [-F] [-g name|root|all] "
+      "[-a count] [-n name] [-N name] [-R regex] [-T tid[,tid...]] "
+      "[-K count] [<pid> ...] <delay>\n"
+      "        sample [options] [<delay>] -- <command> [<arg> ...]\n"
+      "        sample -q [-j count] [-n name] [<pid> ...]\n");
+  fprintf(stderr, "  -r        only sample the running threads\n");
+  fprintf(stderr, "  -w        sample all the threads, report the ones "
+      "that are not running\n"
+      "            separately\n");
+  fprintf(stderr, "  -k        also capture kernel stacks\n");
+  fprintf(stderr, "  -i        reuse the previous stack of threads that "
+      "did not run\n");
+  fprintf(stderr, "  -c        show the CPU time used by each node\n");
+  fprintf(stderr, "  -s count  stop at most count threads per process "
+      "and per tick, show\n");
+  fprintf(stderr, "            estimated counts\n");
+  fprintf(stderr, "  -b usec   stop the threads at most usec per tick, "
+      "lower the rate when\n"
+      "            it is exceeded\n");
+  fprintf(stderr, "  -t        keep the threads traced, find the new "
+      "ones with their clone\n"
+      "            events\n");
+  fprintf(stderr, "  -f        also sample the child processes\n");
+  fprintf(stderr, "  -m        merge the processes with the same "
+      "mappings in one tree\n");
+  fprintf(stderr, "  -p        read the stacks written by "
+      "libsample-preload.so in the\n"
+      "            processes, without stopping them\n");
+  fprintf(stderr, "  -e event[:period]  sample the call chains every "
+      "period page-faults,\n"
+      "            context-switches or cpu-migrations, one tree per "
+      "event\n");
+  fprintf(stderr, "  -D depth  cut the stacks deeper than depth frames, "
+      "%u by default\n", MAX_STACK_DEPTH);
+  fprintf(stderr, "  -F        fold the recursions to one node\n");
+  fprintf(stderr, "  -g name|root|all  merge the trees of the threads "
+      "with the same name, of\n"
+      "            the threads started in the same function, or of all "
+      "the threads\n");
+  fprintf(stderr, "  -o percent  adapt the rate to keep the overhead under "
+      "percent\n");
+  fprintf(stderr, "  -a count  annotate the instructions of the hottest "
+      "functions\n");
+  fprintf(stderr, "  -l        show the samples per source line\n");
+  fprintf(stderr, "  -q        show the stack of each thread once\n");
+  fprintf(stderr, "  -j count  number of processes stopped at the same "
+      "time with -q\n");
+  fprintf(stderr, "  -n name   also the processes whose name matches\n");
+  fprintf(stderr, "  -N name   only the threads whose name matches\n");
+  fprintf(stderr, "  -R regex  only the threads whose name matches the "
+      "extended regex\n");
+  fprintf(stderr, "  -T tid[,tid...]  only these threads\n");
+  fprintf(stderr, "  -K count  only the count threads that used the most "
+      "CPU in the last\n"
+      "            second\n");
+  fprintf(stderr, "  -- command  run the command and sample it from its "
+      "start, until it exits\n"
+      "            when no delay is given\n");
+  exit(EXIT_FAILURE);
 }